@@ -30,248 +30,6319 @@
 #include <errno.h>
 #include <string.h> //strlen(), strcpy(), strcmp()
 #include <fcntl.h> //open()
+#include <sys/inotify.h> //inotify_init1(), inotify_add_watch()
+#include <elf.h> //Elf64_Ehdr, Elf64_Phdr, Elf64_Dyn
+#include <pthread.h> //pthread_create(), pthread_mutex_lock()
+#include <stdatomic.h> //atomic_uint
+#include <linux/futex.h> //FUTEX_WAIT_PRIVATE
+#include <sys/syscall.h> //SYS_futex
+#include <sys/mman.h> //mmap()
+#include <sys/stat.h> //fstat()
+#include <stdint.h> //uint64_t
+#include <getopt.h> //getopt_long()
+#include <signal.h> //sigprocmask()
+#include <sys/epoll.h> //epoll_create1(), epoll_wait()
+#include <sys/socket.h> //socket(), accept4()
+#include <sys/un.h> //struct sockaddr_un
+#include <sys/signalfd.h> //signalfd()
+#include <sys/pidfd.h> //pidfd_open()
+#include <limits.h> //PATH_MAX
+#include <poll.h> //poll()
+#include <time.h> //clock_gettime()
+#include <sys/xattr.h> //getxattr(), setxattr()
+#include <dirent.h> //opendir() for cache eviction
+#include <sys/timerfd.h> //timerfd_create()
+#include <sys/resource.h> //wait4() rusage, setpriority(), setrlimit()
+#include <sched.h> //sched_setaffinity()
 
 #define WHITESPACE " \t\n" //defines delimiters when splitting command line
 #define MAX_COMMAND_SIZE 255
 #define MAX_NUM_ARGUMENTS 12
+#define MAX_NUM_ANNOTATIONS 20 //leading @ tokens of a line, on top of its arguments
 #define MAX_PATH 4096
+#define NUM_SEARCH_PATHS 4
+#define LOOKUP_CACHE_SIZE 64 //slots in the command lookup cache
+#define MAX_CACHED_NAME 64 //longer command names are never cached
+#define BATCH_LOOKAHEAD 8 //batch lines read and prefetched ahead of the running command
 
-int main(int argc, char* argv[] )
+static const char error_message[] = "An error has occurred\n";
+
+static const char *search_path[NUM_SEARCH_PATHS] = {"/bin/", "/usr/bin/", "/usr/local/bin/", "./"}; //where executable commands are
+
+//the lookup cache remembers where each command name resolved to (or that it
+//was not found) so repeated commands skip the access() probes.
+//it stays correct by watching every search directory and the cwd with
+//inotify: any create/delete/rename/chmod in them flushes the whole cache.
+//if any watch cannot be armed the cache is bypassed entirely
+struct lookup_entry
+{
+  int used;
+  int found;
+  int prefetched; //executable already handed to the page cache prefetcher
+  char name[MAX_CACHED_NAME];
+  char path[MAX_PATH];
+};
+
+static struct lookup_entry lookup_cache[LOOKUP_CACHE_SIZE];
+static int inotify_fd = -1;
+static int search_wd[NUM_SEARCH_PATHS]; //watch descriptor per search_path[] entry
+static int cwd_wd = -1; //watch descriptor of the current working directory
+static pthread_mutex_t lookup_lock = PTHREAD_MUTEX_INITIALIZER; //batch reader thread resolves too
+static unsigned int lookup_generation; //bumped on every flush, see lookup_is_current()
+
+#define LOOKUP_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                           IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+
+static void print_error(void)
+{
+  write(STDERR_FILENO, error_message, strlen(error_message));
+}
+
+static void flush_lookup_cache(void)
+{
+  lookup_generation++;
+  for (int i = 0; i < LOOKUP_CACHE_SIZE; i++)
+  {
+    lookup_cache[i].used = 0;
+  }
+}
+
+//returns 1 if the watch descriptor is also used for one of the search
+//directories (inotify hands out the same wd for the same inode)
+static int is_search_wd(int wd)
+{
+  for (int i = 0; i < NUM_SEARCH_PATHS; i++)
+  {
+    if (search_wd[i] == wd)
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+//(re)arms the watch on the current working directory, called at startup and after cd
+static void watch_cwd(void)
+{
+  if (inotify_fd < 0)
+  {
+    return;
+  }
+  if (cwd_wd >= 0 && !is_search_wd(cwd_wd))
+  {
+    inotify_rm_watch(inotify_fd, cwd_wd);
+  }
+  cwd_wd = inotify_add_watch(inotify_fd, ".", LOOKUP_WATCH_MASK);
+}
+
+static void init_lookup_cache(void)
+{
+  inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  for (int i = 0; i < NUM_SEARCH_PATHS; i++)
+  {
+    search_wd[i] = -1;
+    if (inotify_fd >= 0 && strcmp(search_path[i], "./") != 0)
+    {
+      search_wd[i] = inotify_add_watch(inotify_fd, search_path[i], LOOKUP_WATCH_MASK);
+    }
+  }
+  watch_cwd();
+}
+
+//reads every pending inotify event without blocking
+//any event at all means a search directory changed, so the cache is flushed.
+//a directory deleted or moved away reports IN_DELETE_SELF/IN_MOVE_SELF and
+//then IN_IGNORED, after which the cache stays bypassed (lookup_cache_usable)
+static void drain_lookup_events(void)
+{
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t len;
+
+  while ((len = read(inotify_fd, buf, sizeof(buf))) > 0)
+  {
+    for (char *p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len)
+    {
+      struct inotify_event *event = (struct inotify_event*)p;
+      if (event->mask & IN_MOVE_SELF) //a search path now names another directory (the cwd moves along)
+      {
+        for (int i = 0; i < NUM_SEARCH_PATHS; i++)
+        {
+          if (search_wd[i] == event->wd)
+          {
+            inotify_rm_watch(inotify_fd, event->wd);
+            search_wd[i] = -1;
+          }
+        }
+      }
+      if (event->mask & IN_IGNORED) //directory went away, its watch is gone
+      {
+        for (int i = 0; i < NUM_SEARCH_PATHS; i++)
+        {
+          if (search_wd[i] == event->wd)
+          {
+            search_wd[i] = -1;
+          }
+        }
+        if (cwd_wd == event->wd)
+        {
+          cwd_wd = -1;
+        }
+      }
+    }
+    flush_lookup_cache();
+  }
+}
+
+//the cache can only be trusted while every directory it depends on is watched
+static int lookup_cache_usable(void)
+{
+  if (inotify_fd < 0 || cwd_wd < 0)
+  {
+    return 0;
+  }
+  for (int i = 0; i < NUM_SEARCH_PATHS; i++)
+  {
+    if (search_wd[i] < 0 && strcmp(search_path[i], "./") != 0)
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static unsigned int hash_name(const char *name)
+{
+  unsigned int hash = 5381;
+  while (*name)
+  {
+    hash = hash * 33 + (unsigned char)*name++;
+  }
+  return hash;
+}
+
+//a lookup made earlier (e.g. by the batch reader) is still valid if nothing
+//has been flushed since. without a usable cache nothing can be vouched for
+static int lookup_is_current(unsigned int generation)
+{
+  pthread_mutex_lock(&lookup_lock);
+  if (inotify_fd >= 0)
+  {
+    drain_lookup_events();
+  }
+  int current = lookup_cache_usable() && generation == lookup_generation;
+  pthread_mutex_unlock(&lookup_lock);
+  return current;
+}
+
+//returns the cache slot a command name maps to, or NULL if it cannot be cached
+//names with a slash reach into directories nobody watches, so they never are
+static struct lookup_entry *lookup_slot(const char *name)
+{
+  if (!lookup_cache_usable() || strchr(name, '/') != NULL || strlen(name) >= MAX_CACHED_NAME)
+  {
+    return NULL;
+  }
+  return &lookup_cache[hash_name(name) % LOOKUP_CACHE_SIZE];
+}
+
+//finds the executable for a command by walking search_path[]
+//stores the full path in cmd_path and returns 1 if found, 0 otherwise
+//generation receives the lookup_generation the result belongs to
+static int resolve_command(const char *name, char *cmd_path, size_t size, unsigned int *generation)
+{
+  pthread_mutex_lock(&lookup_lock);
+  if (inotify_fd >= 0)
+  {
+    drain_lookup_events();
+  }
+  *generation = lookup_generation;
+
+  struct lookup_entry *entry = lookup_slot(name);
+  if (entry != NULL && entry->used && strcmp(entry->name, name) == 0)
+  {
+    snprintf(cmd_path, size, "%s", entry->path);
+    pthread_mutex_unlock(&lookup_lock);
+    return entry->found;
+  }
+
+  int found = 0;
+  for (int i = 0; i < NUM_SEARCH_PATHS; i++) //loop through each directory in search_path[]
+  {
+    //build full path of command by combining directory and command name (ex: /bin/ls for ls)
+    snprintf(cmd_path, size, "%s%s", search_path[i], name);
+    if (access(cmd_path, X_OK) == 0) //file exists in dir and is executable if access() returns 0
+    {
+      found = 1;
+      break;
+    }
+  }
+
+  if (entry != NULL)
+  {
+    entry->used = 1;
+    entry->found = found;
+    entry->prefetched = 0;
+    strcpy(entry->name, name);
+    snprintf(entry->path, sizeof(entry->path), "%s", cmd_path);
+  }
+  pthread_mutex_unlock(&lookup_lock);
+  return found;
+}
+
+//directories searched for the shared libraries named in DT_NEEDED
+static const char *library_path[] = {"/lib/x86_64-linux-gnu/", "/usr/lib/x86_64-linux-gnu/",
+                                     "/lib/aarch64-linux-gnu/", "/usr/lib/aarch64-linux-gnu/",
+                                     "/lib64/", "/usr/lib64/", "/lib/", "/usr/lib/"};
+
+//asks the kernel to start reading a file into the page cache
+//returns the open descriptor so the caller can inspect the file further
+static int prefetch_file(const char *path)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd >= 0)
+  {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+  }
+  return fd;
+}
+
+//translates a virtual address of an ELF image to a file offset using its PT_LOAD segments
+static off_t elf_vaddr_to_offset(Elf64_Phdr *phdr, int phnum, Elf64_Addr vaddr)
+{
+  for (int i = 0; i < phnum; i++)
+  {
+    if (phdr[i].p_type == PT_LOAD && vaddr >= phdr[i].p_vaddr &&
+        vaddr < phdr[i].p_vaddr + phdr[i].p_filesz)
+    {
+      return (off_t)(vaddr - phdr[i].p_vaddr + phdr[i].p_offset);
+    }
+  }
+  return -1;
+}
+
+//prefetches the program interpreter and the direct DT_NEEDED libraries of a
+//native 64-bit ELF executable. only the headers are read, and anything
+//unusual (other classes, huge tables, libraries outside library_path[]) is
+//simply skipped since this is only a hint
+static void prefetch_elf_dependencies(int fd)
+{
+  Elf64_Ehdr ehdr;
+  Elf64_Phdr phdr[64];
+  Elf64_Dyn dyn[512];
+  char name[MAX_PATH];
+
+  if (pread(fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr) ||
+      memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0 || ehdr.e_ident[EI_CLASS] != ELFCLASS64 ||
+      ehdr.e_phentsize != sizeof(Elf64_Phdr) || ehdr.e_phnum > 64)
+  {
+    return;
+  }
+  int phnum = ehdr.e_phnum;
+  if (pread(fd, phdr, phnum * sizeof(Elf64_Phdr), ehdr.e_phoff) != (ssize_t)(phnum * sizeof(Elf64_Phdr)))
+  {
+    return;
+  }
+
+  int ndyn = 0;
+  for (int i = 0; i < phnum; i++)
+  {
+    if (phdr[i].p_type == PT_INTERP && phdr[i].p_filesz < sizeof(name))
+    {
+      if (pread(fd, name, phdr[i].p_filesz, phdr[i].p_offset) == (ssize_t)phdr[i].p_filesz)
+      {
+        name[phdr[i].p_filesz] = '\0';
+        int interp_fd = prefetch_file(name);
+        if (interp_fd >= 0)
+        {
+          close(interp_fd);
+        }
+      }
+    }
+    else if (phdr[i].p_type == PT_DYNAMIC)
+    {
+      size_t size = phdr[i].p_filesz < sizeof(dyn) ? phdr[i].p_filesz : sizeof(dyn);
+      ssize_t len = pread(fd, dyn, size, phdr[i].p_offset);
+      ndyn = len > 0 ? len / sizeof(Elf64_Dyn) : 0;
+    }
+  }
+
+  off_t strtab = -1;
+  for (int i = 0; i < ndyn && dyn[i].d_tag != DT_NULL; i++)
+  {
+    if (dyn[i].d_tag == DT_STRTAB)
+    {
+      strtab = elf_vaddr_to_offset(phdr, phnum, dyn[i].d_un.d_ptr);
+    }
+  }
+  if (strtab < 0)
+  {
+    return;
+  }
+
+  for (int i = 0; i < ndyn && dyn[i].d_tag != DT_NULL; i++)
+  {
+    if (dyn[i].d_tag != DT_NEEDED)
+    {
+      continue;
+    }
+    char lib[256];
+    ssize_t len = pread(fd, lib, sizeof(lib) - 1, strtab + dyn[i].d_un.d_val);
+    if (len <= 0)
+    {
+      continue;
+    }
+    lib[len] = '\0';
+    if (strlen(lib) == (size_t)len) //name was truncated
+    {
+      continue;
+    }
+    for (size_t j = 0; j < sizeof(library_path) / sizeof(library_path[0]); j++)
+    {
+      snprintf(name, sizeof(name), "%s%s", library_path[j], lib);
+      int lib_fd = prefetch_file(name);
+      if (lib_fd >= 0)
+      {
+        close(lib_fd);
+        break;
+      }
+    }
+  }
+}
+
+//warms the page cache for a resolved executable so the later execv() does
+//not stall on disk reads. each executable is prefetched once per lookup
+//cache lifetime
+static void prefetch_command(const char *name, const char *cmd_path)
+{
+  pthread_mutex_lock(&lookup_lock);
+  struct lookup_entry *entry = lookup_slot(name);
+  if (entry != NULL && entry->used && strcmp(entry->name, name) == 0)
+  {
+    if (entry->prefetched)
+    {
+      pthread_mutex_unlock(&lookup_lock);
+      return;
+    }
+    entry->prefetched = 1;
+  }
+  pthread_mutex_unlock(&lookup_lock);
+
+  int fd = prefetch_file(cmd_path);
+  if (fd >= 0)
+  {
+    prefetch_elf_dependencies(fd);
+    close(fd);
+  }
+}
+
+//what the child changes about itself before execv(), from @cpus, @nice,
+//@ionice and @mem
+struct child_setup
+{
+  int has_cpus;
+  cpu_set_t cpus; //sched_setaffinity()
+  int has_nice;
+  int nice; //setpriority()
+  int ioprio; //ioprio_set() value, 0 to leave it alone
+  rlim_t mem; //RLIMIT_AS, 0 for no limit
+  double timeout; //seconds, 0 for none. the child gets its own process group
+};
+
+static double default_timeout; //--timeout, 0 for none
+
+//a parsed command line, ready to run
+struct command
+{
+  int eof; //marks the end of batch input instead of a command
+  int token_count;
+  char *token[MAX_NUM_ARGUMENTS]; //every token on the line, NULL terminated
+  char *argv[MAX_NUM_ARGUMENTS]; //tokens handed to execv, stops before '>'
+  char *redirect; //output file named after '>', or NULL
+  int syntax_error; //redirection is malformed
+  int annotation_count;
+  char *annotation[MAX_NUM_ANNOTATIONS]; //leading @ tokens, not part of token[]
+  int annotation_error; //unknown or malformed annotation
+  char *label; //@label=NAME
+  int after_count;
+  char *after[MAX_NUM_ANNOTATIONS]; //@after=NAME,NAME...
+  int input_count;
+  char *input[MAX_NUM_ANNOTATIONS]; //@in=FILE,FILE...
+  int pure; //@pure
+  int tag_count;
+  char *tag[MAX_NUM_ANNOTATIONS]; //bare @NAME resource tags
+  struct child_setup setup;
+  int retry; //@retry=N
+  int prio; //@prio=N
+  int line_number; //position in the batch file, 0 for interactive input
+  int found; //cmd_path holds an executable
+  unsigned int lookup_generation; //value of lookup_generation when cmd_path was resolved
+  char cmd_path[MAX_PATH]; //full path for the command
+};
+
+static int is_builtin(const char *name)
+{
+  return strcmp(name, "exit") == 0 || strcmp(name, "quit") == 0 || strcmp(name, "cd") == 0;
+}
+
+//redirection: only one '>' followed by exactly one output file is allowed
+//cuts a NULL terminated argument list before the '>' and stores the output
+//file in redirect (NULL if there is none). returns -1 if it is malformed
+static int split_redirect(char **argv, char **redirect)
+{
+  *redirect = NULL;
+  for (int i = 0; argv[i] != NULL; i++)
+  {
+    if (strcmp(argv[i], ">") == 0)
+    {
+      if (argv[i + 1] == NULL || argv[i + 2] != NULL) //valid output file check after >
+      {
+        argv[i] = NULL;
+        return -1;
+      }
+      *redirect = argv[i + 1];
+      argv[i] = NULL; //trim off the > and output file
+      break;
+    }
+  }
+  return 0;
+}
+
+//line annotations are written in front of the command as @name=value:
+//  @label=NAME         names the line so later lines can depend on it
+//  @after=NAME[,NAME]  runs the line only after the last lines labelled NAME
+//                      have finished, and skips it if any of them failed
+//  @in=FILE[,FILE]     declares the files the line reads; if its '>' output
+//                      is newer than all of them the line is up to date and
+//                      is not run
+//  @pure               the output and status only depend on the command line,
+//                      the working directory and the @in files, so with
+//                      --cache they can be replayed instead of running it again
+//  @NAME               any other bare name tags the line with a resource class,
+//                      --limit NAME=N caps how many such lines run at a time
+//  @cpus=LIST          runs the command on the cpus in LIST, e.g. 0-3,6
+//  @nice=N             runs the command with niceness N
+//  @ionice=CLASS[:N]   io scheduling class idle, be or rt, with level N for be and rt
+//  @mem=SIZE[K|M|G]    limits the address space of the command
+//  @timeout=TIME       stops the command once it ran for TIME (seconds, or
+//                      with an ms, s, m or h suffix), overriding --timeout
+//  @retry=N            runs the command up to N more times while it exits
+//                      nonzero or times out, waiting longer before each try
+//  @prio=N             with -j, starts the line ahead of ready lines with a
+//                      lower priority that have waited less than one second
+//                      per level of difference (N from -1000 to 1000, default 0)
+//
+//names that take a value, a bare one of these is a mistake rather than a tag
+static const char *const valued_annotations[] = {"label", "after", "in", "cpus", "nice", "ionice", "mem", "timeout", "retry", "prio", NULL};
+
+//parses a positive number of bytes with an optional K, M or G suffix,
+//returns -1 if it is malformed
+static int parse_size(const char *text, long *size)
+{
+  char *unit;
+  errno = 0;
+  *size = strtol(text, &unit, 10);
+  int shift = *unit == 'K' ? 10 : *unit == 'M' ? 20 : *unit == 'G' ? 30 : 0;
+  if (errno != 0 || unit == text || *size <= 0 || unit[shift != 0] != '\0' || *size > (LONG_MAX >> shift))
+  {
+    return -1;
+  }
+  *size <<= shift;
+  return 0;
+}
+
+//parses an integer in [min, max], returns -1 if it is malformed
+static int parse_int(const char *text, int min, int max, int *value)
+{
+  char *end;
+  errno = 0;
+  long number = strtol(text, &end, 10);
+  if (errno != 0 || end == text || *end != '\0' || number < min || number > max)
+  {
+    return -1;
+  }
+  *value = number;
+  return 0;
+}
+
+//parses a positive duration in seconds with an optional ms, s, m or h
+//suffix, returns -1 if it is malformed
+static int parse_duration(const char *text, double *seconds)
+{
+  char *unit;
+  errno = 0;
+  *seconds = strtod(text, &unit);
+  double scale = strcmp(unit, "ms") == 0 ? 0.001 : strcmp(unit, "m") == 0 ? 60 : strcmp(unit, "h") == 0 ? 3600 : 1;
+  if (errno != 0 || unit == text || !(*seconds > 0) ||
+      (*unit != '\0' && scale == 1 && strcmp(unit, "s") != 0))
+  {
+    return -1;
+  }
+  *seconds *= scale;
+  return 0;
+}
+
+//cpu list like 0-3,6 into a cpu set, returns -1 if it is malformed
+static int parse_cpu_list(char *list, cpu_set_t *cpus)
+{
+  char *item;
+  CPU_ZERO(cpus);
+  while ((item = strsep(&list, ",")) != NULL)
+  {
+    char *last = strchr(item, '-');
+    int first_cpu, last_cpu;
+    if (last != NULL)
+    {
+      *last++ = '\0';
+    }
+    if (parse_int(item, 0, CPU_SETSIZE - 1, &first_cpu) != 0 ||
+        parse_int(last != NULL ? last : item, first_cpu, CPU_SETSIZE - 1, &last_cpu) != 0)
+    {
+      return -1;
+    }
+    for (int cpu = first_cpu; cpu <= last_cpu; cpu++)
+    {
+      CPU_SET(cpu, cpus);
+    }
+  }
+  return 0;
+}
+
+//io priority classes and how ioprio_set() packs them, from linux/ioprio.h
+#define IOPRIO_CLASS_RT 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+//idle, be[:0-7] or rt[:0-7] into an ioprio value, returns -1 if it is malformed
+static int parse_ionice(char *text, int *ioprio)
+{
+  char *level_text = strchr(text, ':');
+  int level = 4; //the kernel's default level
+  int class;
+  if (level_text != NULL)
+  {
+    *level_text++ = '\0';
+  }
+  if (strcmp(text, "idle") == 0 && level_text == NULL)
+  {
+    class = IOPRIO_CLASS_IDLE;
+    level = 0;
+  }
+  else if (strcmp(text, "be") == 0 || strcmp(text, "rt") == 0)
+  {
+    class = text[0] == 'b' ? IOPRIO_CLASS_BE : IOPRIO_CLASS_RT;
+    if (level_text != NULL && parse_int(level_text, 0, 7, &level) != 0)
+    {
+      return -1;
+    }
+  }
+  else
+  {
+    return -1;
+  }
+  *ioprio = class << IOPRIO_CLASS_SHIFT | level;
+  return 0;
+}
+
+static int is_tag_name(const char *name)
+{
+  for (int i = 0; valued_annotations[i] != NULL; i++)
+  {
+    if (strcmp(name, valued_annotations[i]) == 0)
+    {
+      return 0;
+    }
+  }
+  if (name[0] == '\0')
+  {
+    return 0;
+  }
+  for (const char *c = name; *c != '\0'; c++)
+  {
+    if (!((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9') || *c == '_' || *c == '-'))
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+//splits a comma separated annotation value into list, returns -1 if it has
+//an empty element or too many of them
+static int split_list(char *value, char **list, int *count)
+{
+  char *item;
+  while ((item = strsep(&value, ",")) != NULL)
+  {
+    if (item[0] == '\0' || *count == MAX_NUM_ANNOTATIONS)
+    {
+      return -1;
+    }
+    list[(*count)++] = item;
+  }
+  return 0;
+}
+
+static void parse_annotations(struct command *cmd)
+{
+  for (int i = 0; i < cmd->annotation_count; i++)
+  {
+    char *name = cmd->annotation[i] + 1;
+    char *value = strchr(name, '=');
+    if (strcmp(name, "pure") == 0)
+    {
+      cmd->pure = 1;
+      continue;
+    }
+    if (value == NULL && is_tag_name(name))
+    {
+      cmd->tag[cmd->tag_count++] = name;
+      continue;
+    }
+    if (value == NULL || value[1] == '\0')
+    {
+      cmd->annotation_error = 1;
+      continue;
+    }
+    *value++ = '\0'; //the annotation string is split in place
+    if (strcmp(name, "label") == 0)
+    {
+      cmd->label = value;
+    }
+    else if (strcmp(name, "after") == 0)
+    {
+      cmd->annotation_error |= split_list(value, cmd->after, &cmd->after_count) != 0;
+    }
+    else if (strcmp(name, "in") == 0)
+    {
+      cmd->annotation_error |= split_list(value, cmd->input, &cmd->input_count) != 0;
+    }
+    else if (strcmp(name, "cpus") == 0)
+    {
+      cmd->setup.has_cpus = 1;
+      cmd->annotation_error |= parse_cpu_list(value, &cmd->setup.cpus) != 0;
+    }
+    else if (strcmp(name, "nice") == 0)
+    {
+      cmd->setup.has_nice = 1;
+      cmd->annotation_error |= parse_int(value, -20, 19, &cmd->setup.nice) != 0;
+    }
+    else if (strcmp(name, "ionice") == 0)
+    {
+      cmd->annotation_error |= parse_ionice(value, &cmd->setup.ioprio) != 0;
+    }
+    else if (strcmp(name, "retry") == 0)
+    {
+      cmd->annotation_error |= parse_int(value, 1, 100, &cmd->retry) != 0;
+    }
+    else if (strcmp(name, "prio") == 0)
+    {
+      cmd->annotation_error |= parse_int(value, -1000, 1000, &cmd->prio) != 0;
+    }
+    else if (strcmp(name, "timeout") == 0)
+    {
+      cmd->annotation_error |= parse_duration(value, &cmd->setup.timeout) != 0;
+    }
+    else if (strcmp(name, "mem") == 0)
+    {
+      long size;
+      cmd->annotation_error |= parse_size(value, &size) != 0;
+      cmd->setup.mem = cmd->annotation_error ? 0 : size;
+    }
+    else
+    {
+      cmd->annotation_error = 1;
+    }
+  }
+}
+
+static int line_annotations = 1; //0 for interactive input, where '@' tokens stay part of the command
+
+//splits a command line into tokens and checks its redirection syntax
+//returns the number of tokens found
+static int parse_command(const char *command_string, struct command *cmd)
+{
+  memset(cmd, 0, sizeof(*cmd));
+  cmd->setup.timeout = default_timeout;
+
+  char *argument_pointer; //pointer to current argument parsed by strsep
+  char *working_string = strdup(command_string); //duplicates command string for parsing
+
+  //we are going to move the working_string pointer to
+  //keep track of its original value so we can deallocate
+  //the correct amount at the end
+  char *head_ptr = working_string; //used to free working_string at later point
+
+  //strsep() splits working_string into tokens based on delimiters
+  //each call to strsep() updates working_string to point to the next part of the string
+  while (((argument_pointer = strsep(&working_string, WHITESPACE)) != NULL) &&//while more tokens
+            (cmd->token_count < MAX_NUM_ARGUMENTS - 1)) //reserving space for the NULL terminator
+  {
+    if(strlen(argument_pointer) > 0) //skip tokens that might result from consecutive delimiters
+    //argument_pointer contains token obtained by strsep()
+    {
+      //in batch input, tokens starting with '@' in front of the command
+      //annotate the line and do not count against its arguments
+      if (line_annotations && cmd->token_count == 0 && argument_pointer[0] == '@')
+      {
+        if (cmd->annotation_count < MAX_NUM_ANNOTATIONS)
+        {
+          cmd->annotation[cmd->annotation_count++] = strdup(argument_pointer);
+        }
+        else
+        {
+          cmd->annotation_error = 1;
+        }
+        continue;
+      }
+      cmd->token[cmd->token_count] = strdup(argument_pointer); //duplicate token and store in token array
+      cmd->token_count++;
+    }
+  }
+  free(head_ptr);
+
+  //a line of nothing but annotations is left alone and fails like any other
+  //unknown command
+  if (cmd->token_count == 0 && cmd->annotation_count > 0)
+  {
+    for (int i = 0; i < cmd->annotation_count; i++)
+    {
+      if (cmd->token_count < MAX_NUM_ARGUMENTS - 1)
+      {
+        cmd->token[cmd->token_count++] = cmd->annotation[i];
+      }
+      else
+      {
+        free(cmd->annotation[i]);
+      }
+    }
+    cmd->annotation_count = 0;
+    cmd->annotation_error = 0;
+  }
+  cmd->token[cmd->token_count] = NULL; //has to be NULL terminated for execv to work
+  if (cmd->annotation_count > 0)
+  {
+    parse_annotations(cmd);
+  }
+
+  memcpy(cmd->argv, cmd->token, (cmd->token_count + 1) * sizeof(char*));
+  cmd->syntax_error = split_redirect(cmd->argv, &cmd->redirect) != 0;
+
+  return cmd->token_count;
+}
+
+//looks up the executable for an external command
+static void resolve_parsed_command(struct command *cmd)
+{
+  cmd->found = resolve_command(cmd->token[0], cmd->cmd_path, sizeof(cmd->cmd_path),
+                               &cmd->lookup_generation);
+}
+
+static void free_command(struct command *cmd)
+{
+  for (int i = 0; i < cmd->token_count; i++) //frees each token duplicated by strdup()
+  {
+    free(cmd->token[i]);
+  }
+  for (int i = 0; i < cmd->annotation_count; i++)
+  {
+    free(cmd->annotation[i]);
+  }
+  cmd->token_count = 0;
+  cmd->annotation_count = 0;
+}
+
+//status reported for a command that could not be run at all (not found,
+//bad redirection, failed cd, fork failure)
+#define STATUS_ERROR -1
+
+//status of a command stopped for running past its timeout
+#define STATUS_TIMEOUT -3
+#define TIMEOUT_GRACE 2.0 //seconds from SIGTERM to SIGKILL
+
+//turns a wait status into a shell style exit code, 128 + signal if killed
+static int exit_code(int status)
+{
+  if (status == -1)
+  {
+    return STATUS_ERROR;
+  }
+  if (WIFSIGNALED(status))
+  {
+    return 128 + WTERMSIG(status);
+  }
+  return WEXITSTATUS(status);
+}
+
+//applies the @cpus, @nice, @ionice and @mem of a line to the calling
+//process, returns -1 if one of them cannot be applied
+static int apply_child_setup(const struct child_setup *setup)
+{
+  if (setup->has_cpus && sched_setaffinity(0, sizeof(setup->cpus), &setup->cpus) != 0)
+  {
+    return -1;
+  }
+  if (setup->has_nice && setpriority(PRIO_PROCESS, 0, setup->nice) != 0)
+  {
+    return -1;
+  }
+  if (setup->ioprio != 0 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, setup->ioprio) != 0)
+  {
+    return -1;
+  }
+  struct rlimit limit = {setup->mem, setup->mem};
+  if (setup->mem != 0 && setrlimit(RLIMIT_AS, &limit) != 0)
+  {
+    return -1;
+  }
+  return 0;
+}
+
+//child side of every spawn: applies the line's setup if there is one,
+//redirects stdout and stderr to the redirect file if one is given and
+//replaces the process with the executable.
+//only async-signal-safe calls and _exit() are used, the parent may have
+//other threads holding locks that were copied mid-operation
+static void exec_child(const char *cmd_path, char **argv, const char *redirect, const struct child_setup *setup)
+{
+  sigset_t none;
+  sigemptyset(&none);
+  sigprocmask(SIG_SETMASK, &none, NULL); //the server blocks signals it reads from a signalfd
+
+  if (setup != NULL && setup->timeout > 0)
+  {
+    setpgid(0, 0); //a timeout stops everything the command started
+  }
+  if (setup != NULL && apply_child_setup(setup) != 0)
+  {
+    print_error();
+    _exit(1);
+  }
+
+  if (redirect != NULL)
+  {
+    //opening file for redirection
+    int fd = open(redirect, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd < 0)
+    {
+      print_error();
+      _exit(1);
+    }
+    dup2(fd, STDOUT_FILENO); //redirect stdout to file
+    dup2(fd, STDERR_FILENO); //redirect stderr to file
+    close(fd);
+  }
+
+  //the command only gets stdin, stdout and stderr. whatever msh opens is
+  //O_CLOEXEC already, this also drops descriptors msh inherited itself
+  if (close_range(3, ~0U, 0) != 0) //kernels before 5.9
+  {
+    for (int fd = 3; fd < FD_SETSIZE; fd++) //inherited descriptors are low ones
+    {
+      close(fd);
+    }
+  }
+
+  //execv replaces current process with new process
+  //takes a path to the executable and an array of NULL terminated arguments
+  execv(cmd_path, argv);
+  //could not run executable
+  print_error();
+  _exit(1);
+}
+
+//timeouts are enforced with a timerfd next to a pidfd of the child: when
+//it fires the child's process group gets SIGTERM, and SIGKILL if it is
+//still there TIMEOUT_GRACE seconds later
+struct child_timer
+{
+  int fd; //timerfd, -1 without a timeout
+  int stage; //0 running, 1 SIGTERM sent, 2 SIGKILL sent
+};
+
+static void arm_timer(int fd, double seconds)
+{
+  struct itimerspec when = {{0, 0}, {(time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9)}};
+  if (when.it_value.tv_sec == 0 && when.it_value.tv_nsec == 0)
+  {
+    when.it_value.tv_nsec = 1; //zero would disarm it
+  }
+  timerfd_settime(fd, 0, &when, NULL);
+}
+
+static void child_timer_start(struct child_timer *timer, double timeout)
+{
+  timer->stage = 0;
+  timer->fd = timeout > 0 ? timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC) : -1;
+  if (timer->fd >= 0)
+  {
+    arm_timer(timer->fd, timeout);
+  }
+}
+
+//the timer of the child pid fired
+static void child_timer_expired(struct child_timer *timer, pid_t pid)
+{
+  uint64_t expirations;
+  if (read(timer->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+  {
+    return;
+  }
+  if (timer->stage == 0)
+  {
+    kill(-pid, SIGTERM);
+    arm_timer(timer->fd, TIMEOUT_GRACE);
+  }
+  else
+  {
+    kill(-pid, SIGKILL);
+  }
+  timer->stage++;
+}
+
+static void child_timer_stop(struct child_timer *timer)
+{
+  if (timer->fd >= 0)
+  {
+    close(timer->fd);
+    timer->fd = -1;
+  }
+}
+
+//waits for a child while its timer runs, returns the wait status
+//without a pidfd (kernels before 5.3) the child is checked on with WNOHANG
+//every CHILD_POLL_MS instead, so the timer is still enforced
+#define CHILD_POLL_MS 20
+static int wait_child_timed(pid_t pid, struct child_timer *timer)
+{
+  int status;
+  int pidfd = timer->fd >= 0 ? pidfd_open(pid, 0) : -1;
+  while (timer->fd >= 0)
+  {
+    struct pollfd fds[2] = {{timer->fd, POLLIN, 0}, {pidfd, POLLIN, 0}};
+    int ready = poll(fds, 2, pidfd >= 0 ? -1 : CHILD_POLL_MS);
+    if (ready < 0 && errno != EINTR)
+    {
+      struct timespec pause = {0, CHILD_POLL_MS * 1000000L};
+      nanosleep(&pause, NULL);
+    }
+    else if (ready > 0 && fds[0].revents != 0)
+    {
+      child_timer_expired(timer, pid);
+    }
+    pid_t done = waitpid(pid, &status, WNOHANG);
+    if (done == pid || (done < 0 && errno != EINTR))
+    {
+      if (pidfd >= 0)
+      {
+        close(pidfd);
+      }
+      return done == pid ? status : -1;
+    }
+  }
+  while (waitpid(pid, &status, 0) < 0) //waits until child changes state
+  {
+    if (errno != EINTR)
+    {
+      return -1;
+    }
+  }
+  //status stores the exit status of the child
+  return status;
+}
+
+//fork() fails with EAGAIN or ENOMEM when the system is briefly out of
+//processes or memory. such failures are retried after a jittered
+//exponential backoff, up to SPAWN_RETRY_LIMIT times
+#define SPAWN_RETRY_LIMIT 8
+#define RETRY_BASE_DELAY 0.05 //seconds before the first retry
+#define RETRY_MAX_DELAY 5.0
+
+static long fork_retries; //forks tried again, for --stats
+static long fork_failures; //forks given up on after retrying
+
+//delay before retry number attempt (from 1): doubles every time, and is
+//picked at random from its upper half so retries of many lines spread out
+static double backoff_delay(int attempt)
+{
+  static unsigned int seed;
+  if (seed == 0)
+  {
+    seed = getpid() ^ (unsigned int)time(NULL);
+  }
+  double delay = RETRY_BASE_DELAY * (1 << (attempt < 16 ? attempt - 1 : 15));
+  if (delay > RETRY_MAX_DELAY)
+  {
+    delay = RETRY_MAX_DELAY;
+  }
+  return delay / 2 + delay / 2 * rand_r(&seed) / RAND_MAX;
+}
+
+static void sleep_seconds(double seconds)
+{
+  struct timespec ts = {(time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9)};
+  while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+  {
+  }
+}
+
+//fork() for callers that can wait, retrying transient failures
+static pid_t fork_retry(void)
+{
+  for (int attempt = 1; ; attempt++)
+  {
+    pid_t pid = fork();
+    if (pid >= 0 || (errno != EAGAIN && errno != ENOMEM))
+    {
+      return pid;
+    }
+    if (attempt > SPAWN_RETRY_LIMIT)
+    {
+      fork_failures++;
+      return -1;
+    }
+    fork_retries++;
+    sleep_seconds(backoff_delay(attempt));
+  }
+}
+
+//--zygote: a helper forked at startup, while msh is still small, does the
+//forking for spawn_command. msh sends it the working directory, the
+//executable, the redirection, the arguments and the setup of a line as one
+//SOCK_SEQPACKET message; it forks and execs the child, replies with the pid,
+//then waits for it (timeout included) and replies with the status. the
+//pid reply carries the fork retries the helper made, for --stats. the
+//cost of a fork then no longer grows with msh's heap and caches. if the
+//helper is gone, or a request does not fit in a message, msh forks itself
+#define ZYGOTE_REQUEST_SIZE 65536
+
+struct zygote_request
+{
+  struct child_setup setup;
+  int argc;
+  int has_redirect;
+  //followed by the NUL terminated cwd, cmd_path, redirect and arguments
+};
+
+struct zygote_reply
+{
+  pid_t pid; //-1 if the fork failed
+  int status; //exit code, STATUS_TIMEOUT, or unused in the pid reply
+  long fork_retries; //made for this request, only in the pid reply
+  long fork_failures;
+};
+
+static int zygote_fd = -1; //msh's end of the socketpair
+
+//appends s at p, returns NULL if it does not fit before end
+static char *pack_string(char *p, const char *end, const char *s)
+{
+  size_t len = strlen(s) + 1;
+  if (p == NULL || (size_t)(end - p) < len)
+  {
+    return NULL;
+  }
+  memcpy(p, s, len);
+  return p + len;
+}
+
+//the helper's loop, it exits once msh closes its end
+static void zygote_serve(int fd)
+{
+  char *request = malloc(ZYGOTE_REQUEST_SIZE);
+  ssize_t n;
+  while ((n = recv(fd, request, ZYGOTE_REQUEST_SIZE, 0)) != 0)
+  {
+    if (n < (ssize_t)sizeof(struct zygote_request))
+    {
+      if (n < 0 && errno == EINTR)
+      {
+        continue;
+      }
+      break;
+    }
+    struct zygote_request header;
+    char *argv[MAX_NUM_ARGUMENTS + 1];
+    memcpy(&header, request, sizeof(header));
+    char *cwd = request + sizeof(header);
+    char *cmd_path = cwd + strlen(cwd) + 1;
+    char *redirect = header.has_redirect ? cmd_path + strlen(cmd_path) + 1 : NULL;
+    char *arg = (redirect != NULL ? redirect : cmd_path) + strlen(redirect != NULL ? redirect : cmd_path) + 1;
+    for (int i = 0; i < header.argc; i++)
+    {
+      argv[i] = arg;
+      arg += strlen(arg) + 1;
+    }
+    argv[header.argc] = NULL;
+
+    long retries = fork_retries;
+    long failures = fork_failures;
+    struct zygote_reply reply = {fork_retry(), STATUS_ERROR, 0, 0};
+    reply.fork_retries = fork_retries - retries;
+    reply.fork_failures = fork_failures - failures;
+    if (reply.pid == 0)
+    {
+      if (chdir(cwd) != 0)
+      {
+        print_error();
+        _exit(1);
+      }
+      exec_child(cmd_path, argv, redirect, &header.setup);
+    }
+    send(fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+    if (reply.pid < 0)
+    {
+      continue;
+    }
+    reply.fork_retries = 0;
+    reply.fork_failures = 0;
+    struct child_timer timer;
+    if (header.setup.timeout > 0)
+    {
+      setpgid(reply.pid, reply.pid);
+    }
+    child_timer_start(&timer, header.setup.timeout);
+    int status = wait_child_timed(reply.pid, &timer);
+    child_timer_stop(&timer);
+    reply.status = timer.stage > 0 ? STATUS_TIMEOUT : exit_code(status);
+    send(fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+  }
+  _exit(0);
+}
+
+//returns -1 if the helper could not be started
+static int zygote_start(void)
+{
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) != 0)
+  {
+    return -1;
+  }
+  pid_t pid = fork();
+  if (pid < 0)
+  {
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+  if (pid == 0)
+  {
+    close(fds[0]);
+    zygote_serve(fds[1]);
+  }
+  close(fds[1]);
+  zygote_fd = fds[0];
+  return 0;
+}
+
+static int zygote_receive(struct zygote_reply *reply)
+{
+  ssize_t n;
+  while ((n = recv(zygote_fd, reply, sizeof(*reply), 0)) < 0 && errno == EINTR)
+  {
+  }
+  return n == sizeof(*reply) ? 0 : -1;
+}
+
+//runs a command through the helper and returns 1 with its status in
+//*status_out, or 0 if it could not be handed over and the caller has to fork
+static int zygote_spawn(const char *cmd_path, char **argv, const char *redirect,
+                        const struct child_setup *setup, int *status_out)
+{
+  static char request[ZYGOTE_REQUEST_SIZE];
+  const char *end = request + sizeof(request);
+  struct zygote_request header = {*setup, 0, redirect != NULL};
+  char *p = request + sizeof(header);
+  if (getcwd(p, end - p) == NULL)
+  {
+    return 0;
+  }
+  p += strlen(p) + 1;
+  p = pack_string(p, end, cmd_path);
+  if (redirect != NULL)
+  {
+    p = pack_string(p, end, redirect);
+  }
+  for (; argv[header.argc] != NULL; header.argc++)
+  {
+    p = pack_string(p, end, argv[header.argc]);
+  }
+  if (p == NULL || header.argc > MAX_NUM_ARGUMENTS)
+  {
+    return 0;
+  }
+  memcpy(request, &header, sizeof(header));
+
+  struct zygote_reply reply;
+  if (send(zygote_fd, request, p - request, MSG_NOSIGNAL) < 0 || zygote_receive(&reply) != 0)
+  {
+    close(zygote_fd); //the helper is gone, from now on msh forks itself
+    zygote_fd = -1;
+    return 0;
+  }
+  fork_retries += reply.fork_retries;
+  fork_failures += reply.fork_failures;
+  if (reply.pid < 0)
+  {
+    print_error();
+    *status_out = STATUS_ERROR;
+    return 1;
+  }
+  if (zygote_receive(&reply) != 0)
+  {
+    close(zygote_fd);
+    zygote_fd = -1;
+    reply.status = STATUS_ERROR;
+  }
+  *status_out = reply.status;
+  return 1;
+}
+
+//forks and runs an executable, redirecting stdout and stderr to the
+//redirect file if one is given, and waits for it to finish. setup may be
+//NULL, --timeout still applies then
+//returns the exit code, STATUS_TIMEOUT, or STATUS_ERROR if no child could be started
+static int spawn_command(const char *cmd_path, char **argv, const char *redirect, const struct child_setup *setup)
+{
+  struct child_setup defaults = {.timeout = default_timeout};
+  int status;
+  if (setup == NULL)
+  {
+    setup = &defaults;
+  }
+  if (zygote_fd >= 0 && zygote_spawn(cmd_path, argv, redirect, setup, &status))
+  {
+    return status;
+  }
+  pid_t child_pid = fork_retry(); //new process created
+
+  if (child_pid == -1) //fork failed
+  {
+    print_error();
+    return STATUS_ERROR;
+  }
+
+  if (child_pid == 0)
+  {
+    exec_child(cmd_path, argv, redirect, setup);
+  }
+
+  struct child_timer timer;
+  if (setup->timeout > 0)
+  {
+    setpgid(child_pid, child_pid); //whichever of parent and child gets there first
+  }
+  child_timer_start(&timer, setup->timeout);
+  status = wait_child_timed(child_pid, &timer);
+  child_timer_stop(&timer);
+  return timer.stage > 0 ? STATUS_TIMEOUT : exit_code(status);
+}
+
+//opens dir relative to the directory base as an O_PATH descriptor, the way
+//chdir() would enter it, returns -1 if it cannot be entered
+static int open_directory_at(int base, const char *dir)
+{
+  int fd = openat(base, dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (fd >= 0 && faccessat(fd, ".", X_OK, 0) != 0) //O_PATH skips the search permission check
+  {
+    close(fd);
+    fd = -1;
+  }
+  return fd;
+}
+
+//the cd built-in, returns 0 on success and -1 if the directory does not exist
+static int change_directory(const char *dir)
+{
+  int result = 0;
+  pthread_mutex_lock(&lookup_lock);
+  if (chdir(dir) != 0) //change directory
+  {
+    print_error(); //directory does not exist
+    result = -1;
+  }
+  else
+  {
+    //"./" lookups now refer to a different directory
+    flush_lookup_cache();
+    watch_cwd();
+  }
+  pthread_mutex_unlock(&lookup_lock);
+  return result;
+}
+
+//runs the built-ins exit, quit and cd
+//returns 1 if token[0] named a built-in, 0 if it is an external command.
+//status receives 0 or STATUS_ERROR
+static int run_builtin(char **token, int token_count, int *status)
+{
+  *status = STATUS_ERROR;
+  //handles built-in commands: exit and quit
+  if (strcmp(token[0], "exit") == 0 || strcmp(token[0], "quit") == 0)
+  {
+    if (token_count != 1)
+    {
+      print_error();
+      return 1;
+    }
+    exit(0);
+  }
+  else if (strcmp(token[0], "cd") == 0) //handles built in cd command to change directories
+  {
+    if (token_count != 2) //expects one arg with cd
+    {
+      print_error();
+      return 1;
+    }
+    if (change_directory(token[1]) == 0)
+    {
+      *status = 0;
+    }
+    return 1;
+  }
+  return 0;
+}
+
+//runs one parsed command: the built-ins exit, quit and cd, or an external program
+//returns its exit code, or STATUS_ERROR if it could not be run
+static int run_command(struct command *cmd)
+{
+  int status;
+  if (cmd->annotation_error)
+  {
+    print_error();
+    return STATUS_ERROR;
+  }
+  if (run_builtin(cmd->token, cmd->token_count, &status))
+  {
+    return status;
+  }
+
+  //handles external commands
+  //a lookup done ahead of time is redone if a cd or a change in a search
+  //directory happened in the meantime
+  if (!lookup_is_current(cmd->lookup_generation))
+  {
+    resolve_parsed_command(cmd);
+  }
+
+  //if not found or the redirection is malformed, report it and prompt user again
+  if (!cmd->found || cmd->syntax_error)
+  {
+    print_error();
+    return STATUS_ERROR;
+  }
+
+  return spawn_command(cmd->cmd_path, cmd->argv, cmd->redirect, &cmd->setup);
+}
+
+//string to int hash map (open addressing), used to look up line labels
+struct label_map
+{
+  char **keys;
+  int *values;
+  size_t capacity; //power of two
+  size_t count;
+};
+
+static int *label_map_find(struct label_map *map, const char *key)
+{
+  if (map->capacity == 0)
+  {
+    return NULL;
+  }
+  for (size_t i = hash_name(key) & (map->capacity - 1); map->keys[i] != NULL; i = (i + 1) & (map->capacity - 1))
+  {
+    if (strcmp(map->keys[i], key) == 0)
+    {
+      return &map->values[i];
+    }
+  }
+  return NULL;
+}
+
+static void label_map_put(struct label_map *map, const char *key, int value)
+{
+  int *existing = label_map_find(map, key);
+  if (existing != NULL)
+  {
+    *existing = value;
+    return;
+  }
+  if ((map->count + 1) * 2 > map->capacity) //grow and rehash at half full
+  {
+    struct label_map bigger = {NULL, NULL, map->capacity ? map->capacity * 2 : 64, 0};
+    bigger.keys = calloc(bigger.capacity, sizeof(char*));
+    bigger.values = calloc(bigger.capacity, sizeof(int));
+    for (size_t i = 0; i < map->capacity; i++)
+    {
+      if (map->keys[i] != NULL)
+      {
+        size_t j = hash_name(map->keys[i]) & (bigger.capacity - 1);
+        while (bigger.keys[j] != NULL)
+        {
+          j = (j + 1) & (bigger.capacity - 1);
+        }
+        bigger.keys[j] = map->keys[i];
+        bigger.values[j] = map->values[i];
+      }
+    }
+    bigger.count = map->count;
+    free(map->keys);
+    free(map->values);
+    *map = bigger;
+  }
+  size_t i = hash_name(key) & (map->capacity - 1);
+  while (map->keys[i] != NULL)
+  {
+    i = (i + 1) & (map->capacity - 1);
+  }
+  map->keys[i] = strdup(key);
+  map->values[i] = value;
+  map->count++;
+}
+
+//status of a line that was not run because a line it depends on failed
+#define STATUS_SKIPPED -2
+
+//--stats: counters printed to stderr when msh exits
+static struct run_stats
+{
+  int enabled;
+  double start;
+  long lines; //lines executed or skipped, blank lines excluded
+  long failed; //lines with a nonzero status (skipped ones excluded)
+  long skipped;
+  long up_to_date; //lines not run because their output was newer than their @in files
+  double saved; //seconds those lines took the last time they ran
+  long memo_hits; //@pure lines replayed from the --cache
+  double memo_saved; //seconds those lines took when they were captured
+  long resumed; //lines the --journal had as done by an earlier run
+  long coalesced; //lines that shared the result of an identical running line (--dedup)
+  long timed_out; //lines stopped by their timeout
+  long reruns; //@retry runs after a failure
+  long recovered; //@retry lines that succeeded on a later run
+  int parallel; //the critical path was measured
+  double critical_path; //seconds along the longest dependency chain
+  long critical_lines; //lines on that chain
+} stats;
+
+static double now_seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void count_status(int status)
+{
+  stats.lines++;
+  if (status == STATUS_SKIPPED)
+  {
+    stats.skipped++;
+  }
+  else if (status != 0)
+  {
+    stats.failed++;
+    stats.timed_out += status == STATUS_TIMEOUT;
+  }
+}
+
+static void print_stats(void)
+{
+  char report[1024];
+  int len = snprintf(report, sizeof(report), "msh: %ld lines, %ld failed, %ld skipped, %.3fs\n",
+                     stats.lines, stats.failed, stats.skipped, now_seconds() - stats.start);
+  if (stats.up_to_date > 0)
+  {
+    len += snprintf(report + len, sizeof(report) - len, "msh: %ld lines up to date, %.3fs saved\n",
+                    stats.up_to_date, stats.saved);
+  }
+  if (stats.resumed > 0)
+  {
+    len += snprintf(report + len, sizeof(report) - len, "msh: %ld lines done by an earlier run\n",
+                    stats.resumed);
+  }
+  if (stats.timed_out > 0)
+  {
+    len += snprintf(report + len, sizeof(report) - len, "msh: %ld lines timed out\n", stats.timed_out);
+  }
+  if (fork_retries > 0 || fork_failures > 0)
+  {
+    len += snprintf(report + len, sizeof(report) - len, "msh: %ld fork retries, %ld forks failed\n",
+                    fork_retries, fork_failures);
+  }
+  if (stats.reruns > 0)
+  {
+    len += snprintf(report + len, sizeof(report) - len, "msh: %ld reruns for @retry, %ld lines recovered\n",
+                    stats.reruns, stats.recovered);
+  }
+  if (stats.coalesced > 0)
+  {
+    len += snprintf(report + len, sizeof(report) - len, "msh: %ld lines coalesced with identical running lines\n",
+                    stats.coalesced);
+  }
+  if (stats.memo_hits > 0)
+  {
+    len += snprintf(report + len, sizeof(report) - len, "msh: %ld cache hits, %.3fs saved\n",
+                    stats.memo_hits, stats.memo_saved);
+  }
+  if (stats.parallel)
+  {
+    len += snprintf(report + len, sizeof(report) - len, "msh: critical path %.3fs over %ld lines\n",
+                    stats.critical_path, stats.critical_lines);
+  }
+  write(STDERR_FILENO, report, len);
+}
+
+//make-style incremental execution
+//how long a line took is kept in an extended attribute of its output file,
+//so the time an up to date line saves can be reported without a state file
+#define DURATION_XATTR "user.msh.seconds"
+
+static int older(struct timespec a, struct timespec b)
+{
+  return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+}
+
+//returns 1 if the line declares inputs and its output is newer than every
+//one of them. saved receives the recorded duration of the line, or 0
+static int output_up_to_date(struct command *cmd, double *saved)
+{
+  struct stat out, in;
+  *saved = 0;
+  if (cmd->input_count == 0 || cmd->redirect == NULL || cmd->syntax_error ||
+      stat(cmd->redirect, &out) != 0)
+  {
+    return 0;
+  }
+  for (int i = 0; i < cmd->input_count; i++)
+  {
+    if (stat(cmd->input[i], &in) != 0 || !older(in.st_mtim, out.st_mtim))
+    {
+      return 0;
+    }
+  }
+  char value[32];
+  ssize_t len = getxattr(cmd->redirect, DURATION_XATTR, value, sizeof(value) - 1);
+  if (len > 0)
+  {
+    value[len] = '\0';
+    *saved = atof(value);
+  }
+  return 1;
+}
+
+//remembers how long a line with declared inputs took to produce its output
+static void record_duration(const char *output, double seconds)
+{
+  char value[32];
+  int len = snprintf(value, sizeof(value), "%.6f", seconds);
+  setxattr(output, DURATION_XATTR, value, len, 0);
+}
+
+//counts a line that was not run because it is up to date
+static void count_up_to_date(double saved)
+{
+  stats.up_to_date++;
+  stats.saved += saved;
+  count_status(0);
+}
+
+//fast non-cryptographic 64-bit hash, mixes eight bytes at a time
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t len)
+{
+  const unsigned char *p = data;
+  const uint64_t multiplier = 0x9e3779b97f4a7c15ULL;
+  uint64_t word;
+
+  for (; len >= 8; p += 8, len -= 8)
+  {
+    memcpy(&word, p, 8);
+    hash = (hash ^ word) * multiplier;
+    hash ^= hash >> 29;
+  }
+  word = 0;
+  memcpy(&word, p, len);
+  hash = (hash ^ word ^ ((uint64_t)len << 56)) * multiplier;
+  return hash ^ (hash >> 32);
+}
+
+//maps a whole file read-only, returns NULL on failure or if it is empty
+static void *map_file(const char *path, size_t *size)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    return NULL;
+  }
+  struct stat st;
+  void *map = NULL;
+  if (fstat(fd, &st) == 0 && st.st_size > 0)
+  {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+    {
+      map = NULL;
+    }
+    *size = st.st_size;
+  }
+  close(fd);
+  return map;
+}
+
+static void write_all(int fd, const char *data, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t n = write(fd, data, len);
+    if (n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (n <= 0)
+    {
+      return;
+    }
+    data += n;
+    len -= n;
+  }
+}
+
+//memoization of @pure lines (--cache DIR)
+//a pure line's output and exit code depend only on its executable, its
+//arguments, the working directory and the contents of its @in files. the
+//first run is captured and stored, later runs replay it without forking
+//  DIR/blobs/HASH   captured output, named after its content so equal
+//                   outputs are stored once
+//  DIR/entries/KEY  "status seconds stdout_blob stderr_blob", touched on
+//                   every hit so the least recently used entries are the
+//                   first evicted once the blobs outgrow --cache-size
+#define MEMO_DEFAULT_LIMIT (256L << 20)
+#define MEMO_NAME_SIZE 33 //128-bit hash in hex
+#define MEMO_EMPTY "-" //blob name of empty output, nothing is stored for it
+
+static const char *memo_dir; //NULL unless --cache was given
+static long memo_limit = MEMO_DEFAULT_LIMIT;
+static long memo_bytes; //size of all blobs as of the last scan plus what was added since
+
+//two differently seeded hashes make the 128-bit names
+static void memo_feed(uint64_t *key, const void *data, size_t len)
+{
+  key[0] = hash_bytes(key[0], data, len);
+  key[1] = hash_bytes(key[1] ^ 0x5bd1e995ULL, data, len);
+}
+
+static void memo_name(uint64_t *key, char *name)
+{
+  snprintf(name, MEMO_NAME_SIZE, "%016llx%016llx", (unsigned long long)key[0], (unsigned long long)key[1]);
+}
+
+//computes the cache key of a resolved command into name
+//returns -1 if the executable or one of the @in files cannot be read
+static int memo_key(struct command *cmd, char *name)
+{
+  uint64_t key[2] = {1, 2};
+  struct stat st;
+  char cwd[MAX_PATH];
+  if (stat(cmd->cmd_path, &st) != 0 || getcwd(cwd, sizeof(cwd)) == NULL)
+  {
+    return -1;
+  }
+  memo_feed(key, cmd->cmd_path, strlen(cmd->cmd_path) + 1);
+  memo_feed(key, &st.st_dev, sizeof(st.st_dev));
+  memo_feed(key, &st.st_ino, sizeof(st.st_ino));
+  memo_feed(key, &st.st_size, sizeof(st.st_size));
+  memo_feed(key, &st.st_mtim, sizeof(st.st_mtim));
+  memo_feed(key, cwd, strlen(cwd) + 1);
+  for (int i = 0; cmd->argv[i] != NULL; i++)
+  {
+    memo_feed(key, cmd->argv[i], strlen(cmd->argv[i]) + 1);
+  }
+  int merged = cmd->redirect != NULL; //stdout and stderr were captured together
+  memo_feed(key, &merged, sizeof(merged));
+  memo_feed(key, &cmd->setup, sizeof(cmd->setup)); //zeroed with the command, padding included
+  for (int i = 0; i < cmd->input_count; i++)
+  {
+    memo_feed(key, cmd->input[i], strlen(cmd->input[i]) + 1);
+    if (stat(cmd->input[i], &st) != 0)
+    {
+      return -1;
+    }
+    size_t size = 0;
+    void *map = st.st_size > 0 ? map_file(cmd->input[i], &size) : NULL;
+    if (st.st_size > 0 && map == NULL)
+    {
+      return -1;
+    }
+    memo_feed(key, map, size);
+    if (map != NULL)
+    {
+      munmap(map, size);
+    }
+  }
+  memo_name(key, name);
+  return 0;
+}
+
+static void memo_path(char *path, const char *kind, const char *name)
+{
+  snprintf(path, MAX_PATH, "%s/%s/%s", memo_dir, kind, name);
+}
+
+//one line of an entry file, returns 0 if it was read
+static int memo_read_entry(const char *key, int *status, double *seconds, char *out, char *err)
+{
+  char path[MAX_PATH];
+  memo_path(path, "entries", key);
+  FILE *entry = fopen(path, "re");
+  if (entry == NULL)
+  {
+    return -1;
+  }
+  int fields = fscanf(entry, "%d %lf %32s %32s", status, seconds, out, err);
+  fclose(entry);
+  return fields == 4 ? 0 : -1;
+}
+
+static int memo_blob_exists(const char *name)
+{
+  char path[MAX_PATH];
+  memo_path(path, "blobs", name);
+  return strcmp(name, MEMO_EMPTY) == 0 || access(path, F_OK) == 0;
+}
+
+static void memo_write_blob(const char *name, int fd)
+{
+  char path[MAX_PATH];
+  size_t size;
+  if (strcmp(name, MEMO_EMPTY) == 0)
+  {
+    return;
+  }
+  memo_path(path, "blobs", name);
+  char *map = map_file(path, &size);
+  if (map != NULL)
+  {
+    write_all(fd, map, size);
+    munmap(map, size);
+  }
+}
+
+//replays a cached result: writes the stored output to the redirect file or
+//to stdout and stderr. returns 1 on a hit with status set, 0 on a miss.
+//a line with @retry is meant to run again after a failure, so for it a
+//cached failure is a miss
+static int memo_replay(const char *key, const char *redirect, int retry, int *status)
+{
+  char out[MEMO_NAME_SIZE], err[MEMO_NAME_SIZE];
+  double seconds;
+  if (memo_read_entry(key, status, &seconds, out, err) != 0 || (retry > 0 && *status != 0) ||
+      !memo_blob_exists(out) || !memo_blob_exists(err))
+  {
+    return 0;
+  }
+  int fd = STDOUT_FILENO;
+  if (redirect != NULL)
+  {
+    fd = open(redirect, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd < 0)
+    {
+      print_error();
+      *status = 1; //what the child would have exited with
+      return 1;
+    }
+  }
+  memo_write_blob(out, fd);
+  memo_write_blob(err, redirect != NULL ? fd : STDERR_FILENO);
+  if (redirect != NULL)
+  {
+    close(fd);
+  }
+
+  char path[MAX_PATH];
+  memo_path(path, "entries", key);
+  utimensat(AT_FDCWD, path, NULL, 0); //most recently used
+  stats.memo_hits++;
+  stats.memo_saved += seconds;
+  return 1;
+}
+
+//a new file appears under its final name only once it is complete
+static int memo_write_file(const char *kind, const char *name, const char *data, size_t len)
+{
+  char tmp[MAX_PATH], path[MAX_PATH];
+  snprintf(tmp, sizeof(tmp), "%s/%s/.tmp.%d", memo_dir, kind, (int)getpid());
+  memo_path(path, kind, name);
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  write_all(fd, data, len);
+  close(fd);
+  if (rename(tmp, path) != 0)
+  {
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+//stores captured output unless the same content is already there
+static int memo_store_blob(const char *data, size_t len, char *name)
+{
+  uint64_t key[2] = {1, 2};
+  char path[MAX_PATH];
+  if (len == 0)
+  {
+    strcpy(name, MEMO_EMPTY);
+    return 0;
+  }
+  memo_feed(key, data, len);
+  memo_name(key, name);
+  memo_path(path, "blobs", name);
+  if (access(path, F_OK) == 0)
+  {
+    return 0;
+  }
+  if (memo_write_file("blobs", name, data, len) != 0)
+  {
+    return -1;
+  }
+  memo_bytes += len;
+  return 0;
+}
+
+struct memo_entry
+{
+  char key[MEMO_NAME_SIZE];
+  char blob[2][MEMO_NAME_SIZE];
+  struct timespec used;
+};
+
+static int memo_entry_older(const void *a, const void *b)
+{
+  const struct memo_entry *x = a, *y = b;
+  return older(x->used, y->used) ? -1 : older(y->used, x->used);
+}
+
+//drops a reference to a blob, deleting it with its last one
+static void memo_release_blob(struct label_map *refs, const char *name)
+{
+  int *count = label_map_find(refs, name);
+  if (count != NULL && --*count == 0)
+  {
+    char path[MAX_PATH];
+    struct stat st;
+    memo_path(path, "blobs", name);
+    if (stat(path, &st) == 0 && unlink(path) == 0)
+    {
+      memo_bytes -= st.st_size;
+    }
+  }
+}
+
+//recounts the size of the cache, deletes blobs no entry refers to, and
+//evicts least recently used entries until the blobs fit in memo_limit
+static void memo_evict(void)
+{
+  char path[MAX_PATH];
+  struct label_map refs = {NULL, NULL, 0, 0}; //blob name to number of entries using it
+  struct memo_entry *entries = NULL;
+  size_t count = 0, capacity = 0;
+  struct dirent *de;
+  struct stat st;
+
+  snprintf(path, sizeof(path), "%s/entries", memo_dir);
+  DIR *dir = opendir(path);
+  while (dir != NULL && (de = readdir(dir)) != NULL)
+  {
+    struct memo_entry e;
+    int status;
+    double seconds;
+    if (de->d_name[0] == '.' || strlen(de->d_name) != MEMO_NAME_SIZE - 1)
+    {
+      continue;
+    }
+    strcpy(e.key, de->d_name);
+    memo_path(path, "entries", e.key);
+    if (memo_read_entry(e.key, &status, &seconds, e.blob[0], e.blob[1]) != 0 || stat(path, &st) != 0)
+    {
+      unlink(path); //unreadable, so useless
+      continue;
+    }
+    e.used = st.st_mtim;
+    if (count == capacity)
+    {
+      capacity = capacity ? capacity * 2 : 64;
+      entries = realloc(entries, capacity * sizeof(*entries));
+    }
+    entries[count++] = e;
+    for (int i = 0; i < 2; i++)
+    {
+      int *refcount = label_map_find(&refs, e.blob[i]);
+      label_map_put(&refs, e.blob[i], refcount != NULL ? *refcount + 1 : 1);
+    }
+  }
+  if (dir != NULL)
+  {
+    closedir(dir);
+  }
+
+  memo_bytes = 0;
+  snprintf(path, sizeof(path), "%s/blobs", memo_dir);
+  dir = opendir(path);
+  while (dir != NULL && (de = readdir(dir)) != NULL)
+  {
+    if (de->d_name[0] == '.') //also skips blobs other processes are still writing
+    {
+      continue;
+    }
+    memo_path(path, "blobs", de->d_name);
+    if (label_map_find(&refs, de->d_name) == NULL)
+    {
+      unlink(path);
+    }
+    else if (stat(path, &st) == 0)
+    {
+      memo_bytes += st.st_size;
+    }
+  }
+  if (dir != NULL)
+  {
+    closedir(dir);
+  }
+
+  qsort(entries, count, sizeof(*entries), memo_entry_older);
+  for (size_t i = 0; i < count && memo_bytes > memo_limit; i++)
+  {
+    memo_path(path, "entries", entries[i].key);
+    unlink(path);
+    memo_release_blob(&refs, entries[i].blob[0]);
+    memo_release_blob(&refs, entries[i].blob[1]);
+  }
+
+  for (size_t i = 0; i < refs.capacity; i++)
+  {
+    free(refs.keys[i]);
+  }
+  free(refs.keys);
+  free(refs.values);
+  free(entries);
+}
+
+//creates the cache directories and trims the cache to its size limit
+static int memo_open(const char *dir)
+{
+  char path[MAX_PATH];
+  memo_dir = dir;
+  mkdir(dir, 0777);
+  snprintf(path, sizeof(path), "%s/blobs", dir);
+  mkdir(path, 0777);
+  snprintf(path, sizeof(path), "%s/entries", dir);
+  mkdir(path, 0777);
+  if (access(path, W_OK) != 0)
+  {
+    return -1;
+  }
+  memo_evict();
+  return 0;
+}
+
+//adds the blobs of an entry a capture process just wrote to memo_bytes and
+//evicts once they no longer fit. -j runs captures in their own process,
+//whose memo_bytes goes away with it. a blob an older entry already had is
+//counted again, memo_evict() recounts before it deletes anything
+static void memo_account(const char *key)
+{
+  char blob[2][MEMO_NAME_SIZE];
+  char path[MAX_PATH];
+  struct stat st;
+  int status;
+  double seconds;
+  if (memo_read_entry(key, &status, &seconds, blob[0], blob[1]) != 0)
+  {
+    return;
+  }
+  for (int i = 0; i < 2; i++)
+  {
+    memo_path(path, "blobs", blob[i]);
+    if (strcmp(blob[i], MEMO_EMPTY) != 0 && stat(path, &st) == 0)
+    {
+      memo_bytes += st.st_size;
+    }
+  }
+  if (memo_bytes > memo_limit)
+  {
+    memo_evict();
+  }
+}
+
+struct memo_capture
+{
+  int fd; //read end of the pipe
+  int dest; //where the output is copied to as it arrives
+  char *data;
+  size_t len;
+  size_t capacity;
+};
+
+//reads what is available from a capture pipe, returns 0 once it is closed
+static int memo_read(struct memo_capture *c)
+{
+  char buffer[65536];
+  ssize_t n = read(c->fd, buffer, sizeof(buffer));
+  if (n < 0 && errno == EINTR)
+  {
+    return 1;
+  }
+  if (n <= 0)
+  {
+    close(c->fd);
+    c->fd = -1;
+    return 0;
+  }
+  write_all(c->dest, buffer, n);
+  if (c->len + n > c->capacity)
+  {
+    c->capacity = (c->len + n) * 2;
+    c->data = realloc(c->data, c->capacity);
+  }
+  memcpy(c->data + c->len, buffer, n);
+  c->len += n;
+  return 1;
+}
+
+//runs a resolved pure command with its output captured through pipes and
+//copied on to where it would have gone, then stores the result under key
+//returns the exit code like run_command()
+static int memo_capture(struct command *cmd, const char *key)
+{
+  struct memo_capture capture[2] = {{-1, STDOUT_FILENO, NULL, 0, 0}, {-1, STDERR_FILENO, NULL, 0, 0}};
+  int out[2], err[2];
+  int redirect_fd = -1;
+
+  if (cmd->redirect != NULL)
+  {
+    redirect_fd = open(cmd->redirect, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (redirect_fd < 0)
+    {
+      print_error();
+      return 1; //what the child would have exited with
+    }
+    capture[0].dest = capture[1].dest = redirect_fd;
+  }
+  if (pipe2(out, O_CLOEXEC) != 0)
+  {
+    out[0] = out[1] = -1;
+  }
+  else if (pipe2(err, O_CLOEXEC) != 0)
+  {
+    close(out[0]);
+    close(out[1]);
+    out[0] = out[1] = -1;
+  }
+  if (out[0] < 0)
+  {
+    if (redirect_fd >= 0)
+    {
+      close(redirect_fd);
+    }
+    print_error();
+    return STATUS_ERROR;
+  }
+
+  double start = now_seconds();
+  pid_t pid = fork_retry();
+  if (pid == 0)
+  {
+    dup2(out[1], STDOUT_FILENO);
+    dup2(cmd->redirect != NULL ? out[1] : err[1], STDERR_FILENO); //keeps the order in one file
+    exec_child(cmd->cmd_path, cmd->argv, NULL, &cmd->setup);
+  }
+  close(out[1]);
+  close(err[1]);
+  capture[0].fd = out[0];
+  capture[1].fd = err[0];
+  if (pid < 0)
+  {
+    close(out[0]);
+    close(err[0]);
+    if (redirect_fd >= 0)
+    {
+      close(redirect_fd);
+    }
+    print_error();
+    return STATUS_ERROR;
+  }
+
+  struct child_timer timer;
+  if (cmd->setup.timeout > 0)
+  {
+    setpgid(pid, pid);
+  }
+  child_timer_start(&timer, cmd->setup.timeout);
+  int open_pipes = 2;
+  int complete = 1;
+  while (open_pipes > 0)
+  {
+    struct pollfd fds[3] = {{capture[0].fd, POLLIN, 0}, {capture[1].fd, POLLIN, 0}, {timer.fd, POLLIN, 0}};
+    if (poll(fds, 3, -1) < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      for (int i = 0; i < 2; i++) //give up on the capture, the child still gets waited for
+      {
+        if (capture[i].fd >= 0)
+        {
+          close(capture[i].fd);
+          capture[i].fd = -1;
+        }
+      }
+      complete = 0;
+      break;
+    }
+    for (int i = 0; i < 2; i++)
+    {
+      if (fds[i].revents != 0 && !memo_read(&capture[i]))
+      {
+        open_pipes--;
+      }
+    }
+    if (fds[2].revents != 0)
+    {
+      child_timer_expired(&timer, pid);
+    }
+  }
+
+  int wstatus = wait_child_timed(pid, &timer);
+  child_timer_stop(&timer);
+  int status = timer.stage > 0 ? STATUS_TIMEOUT : exit_code(wstatus);
+  char blob[2][MEMO_NAME_SIZE];
+  if (complete && status != STATUS_TIMEOUT && (status == 0 || cmd->retry == 0) && WIFEXITED(wstatus) &&
+      memo_store_blob(capture[0].data, capture[0].len, blob[0]) == 0 &&
+      memo_store_blob(capture[1].data, capture[1].len, blob[1]) == 0)
+  {
+    char entry[128];
+    int len = snprintf(entry, sizeof(entry), "%d %.6f %s %s\n", status, now_seconds() - start, blob[0], blob[1]);
+    memo_write_file("entries", key, entry, len);
+    if (memo_bytes > memo_limit)
+    {
+      memo_evict();
+    }
+  }
+  if (redirect_fd >= 0)
+  {
+    close(redirect_fd);
+  }
+  free(capture[0].data);
+  free(capture[1].data);
+  return status;
+}
+
+//whether a line is run through the cache at all: built-ins and lines that
+//cannot run never are
+static int memo_applies(struct command *cmd)
+{
+  return memo_dir != NULL && cmd->pure && !cmd->annotation_error && !is_builtin(cmd->token[0]) &&
+         cmd->found && !cmd->syntax_error;
+}
+
+//runs a @pure line through the cache, returns the exit code like run_command()
+static int run_memoized(struct command *cmd)
+{
+  char key[MEMO_NAME_SIZE];
+  int status;
+  if (!lookup_is_current(cmd->lookup_generation))
+  {
+    resolve_parsed_command(cmd);
+  }
+  if (!memo_applies(cmd))
+  {
+    return run_command(cmd);
+  }
+  if (memo_key(cmd, key) != 0)
+  {
+    return spawn_command(cmd->cmd_path, cmd->argv, cmd->redirect, &cmd->setup); //cannot be cached
+  }
+  if (memo_replay(key, cmd->redirect, cmd->retry, &status))
+  {
+    return status;
+  }
+  return memo_capture(cmd, key);
+}
+
+//--journal: crash-safe record of finished batch lines
+//the journal starts with "msh-journal HASH" of the batch file and gets a
+//"LINE STATUS" record as every line finishes. a record is written as soon
+//as its line finishes, so it survives msh being killed, and records are
+//synced to disk in groups so a machine crash loses at most a few of them
+//without paying for a sync per line. --resume skips the lines the journal
+//has as succeeded, except cd lines which are always run again
+#define JOURNAL_SYNC_RECORDS 64
+#define JOURNAL_SYNC_SECONDS 0.05
+
+static struct
+{
+  int fd; //-1 unless --journal was given
+  unsigned char *done; //done[line] is set for lines that already succeeded
+  int done_size;
+  int unsynced; //records written since the last fdatasync()
+  double last_sync;
+} journal = {-1, NULL, 0, 0, 0};
+
+static void journal_sync(void)
+{
+  if (journal.unsynced > 0)
+  {
+    fdatasync(journal.fd);
+    journal.unsynced = 0;
+  }
+  journal.last_sync = now_seconds();
+}
+
+//flushes the last group of records when msh exits
+static void journal_close(void)
+{
+  if (journal.fd >= 0)
+  {
+    journal_sync();
+    close(journal.fd);
+    journal.fd = -1;
+  }
+}
+
+static int journal_is_done(int line)
+{
+  return line > 0 && line < journal.done_size && journal.done[line];
+}
+
+static void journal_mark_done(int line, int done)
+{
+  if (line >= journal.done_size)
+  {
+    int size = journal.done_size ? journal.done_size : 1024;
+    while (size <= line)
+    {
+      size *= 2;
+    }
+    journal.done = realloc(journal.done, size);
+    memset(journal.done + journal.done_size, 0, size - journal.done_size);
+    journal.done_size = size;
+  }
+  journal.done[line] = done;
+}
+
+//opens the journal for a batch file. with resume the lines an existing
+//journal of the same batch file has as succeeded are loaded, and the
+//journal is rewritten with just those so a torn last record from a crash
+//is dropped. returns -1 if the journal belongs to another batch file or
+//cannot be written
+static int journal_open(const char *path, const char *batch_path, int resume)
+{
+  size_t size = 0;
+  char *text = map_file(batch_path, &size);
+  char header[64];
+  snprintf(header, sizeof(header), "msh-journal %016llx\n",
+           (unsigned long long)(text != NULL ? hash_bytes(0, text, size) : 0));
+  if (text != NULL)
+  {
+    munmap(text, size);
+  }
+
+  FILE *old = resume ? fopen(path, "re") : NULL;
+  if (old != NULL)
+  {
+    char line[64];
+    int number, status;
+    if (fgets(line, sizeof(line), old) == NULL || strcmp(line, header) != 0)
+    {
+      fclose(old);
+      return -1;
+    }
+    while (fscanf(old, "%d %d", &number, &status) == 2)
+    {
+      if (number > 0)
+      {
+        journal_mark_done(number, status == 0); //a later record of a line replaces an earlier one
+      }
+    }
+    fclose(old);
+  }
+
+  char tmp_path[MAX_PATH];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+  FILE *out = fopen(tmp_path, "we");
+  if (out == NULL)
+  {
+    return -1;
+  }
+  fputs(header, out);
+  for (int i = 1; i < journal.done_size; i++)
+  {
+    if (journal.done[i])
+    {
+      fprintf(out, "%d 0\n", i);
+    }
+  }
+  if (fflush(out) != 0 || fdatasync(fileno(out)) != 0 || rename(tmp_path, path) != 0)
+  {
+    fclose(out);
+    unlink(tmp_path);
+    return -1;
+  }
+  fclose(out);
+
+  journal.fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+  if (journal.fd < 0)
+  {
+    return -1;
+  }
+  journal.last_sync = now_seconds();
+  atexit(journal_close);
+  return 0;
+}
+
+//whether a line can be skipped because it succeeded in an earlier run
+static int journal_skips(struct command *cmd)
+{
+  return journal_is_done(cmd->line_number) && strcmp(cmd->token[0], "cd") != 0;
+}
+
+//adds the record of a finished batch line, syncing every few records
+static void journal_record(int line, int status)
+{
+  if (journal.fd < 0 || line <= 0 || (status == 0 && journal_is_done(line)))
+  {
+    return;
+  }
+  char record[32];
+  int len = snprintf(record, sizeof(record), "%d %d\n", line, status);
+  write_all(journal.fd, record, len);
+  if (++journal.unsynced >= JOURNAL_SYNC_RECORDS || now_seconds() - journal.last_sync >= JOURNAL_SYNC_SECONDS)
+  {
+    journal_sync();
+  }
+}
+
+//whether a failed run is tried again for @retry
+static int retryable(int status)
+{
+  return status > 0 || status == STATUS_TIMEOUT;
+}
+
+//runs a line's command, again after a backoff for as long as @retry allows
+static int run_with_retries(struct command *cmd)
+{
+  int status = cmd->pure ? run_memoized(cmd) : run_command(cmd);
+  for (int attempt = 1; attempt <= cmd->retry && retryable(status); attempt++)
+  {
+    stats.reruns++;
+    sleep_seconds(backoff_delay(attempt));
+    status = cmd->pure ? run_memoized(cmd) : run_command(cmd);
+    stats.recovered += status == 0;
+  }
+  return status;
+}
+
+//last status of every label, for lines run one after another
+static struct label_map label_status;
+
+//runs a line in interactive or sequential batch mode, honoring its @after
+//dependencies and recording its status under its @label
+static int run_line(struct command *cmd)
+{
+  int status = 0;
+  if (journal_skips(cmd))
+  {
+    stats.resumed++;
+    count_status(0);
+    if (cmd->label != NULL)
+    {
+      label_map_put(&label_status, cmd->label, 0);
+    }
+    return 0;
+  }
+  for (int i = 0; i < cmd->after_count && status == 0; i++)
+  {
+    int *dep = label_map_find(&label_status, cmd->after[i]);
+    if (dep == NULL) //depending on a label no earlier line had
+    {
+      print_error();
+      status = STATUS_ERROR;
+    }
+    else if (*dep != 0)
+    {
+      status = STATUS_SKIPPED;
+    }
+  }
+  double saved;
+  if (status == 0 && !cmd->annotation_error && output_up_to_date(cmd, &saved))
+  {
+    count_up_to_date(saved);
+  }
+  else
+  {
+    double start = now_seconds();
+    if (status == 0)
+    {
+      status = run_with_retries(cmd);
+    }
+    if (status == 0 && cmd->input_count > 0 && cmd->redirect != NULL)
+    {
+      record_duration(cmd->redirect, now_seconds() - start);
+    }
+    count_status(status);
+  }
+  if (cmd->label != NULL)
+  {
+    label_map_put(&label_status, cmd->label, status);
+  }
+  journal_record(cmd->line_number, status);
+  return status;
+}
+
+//--watch: runs a batch file and then runs it again whenever it or one of
+//its @in files changes. a pass only runs the lines that are new or were
+//edited since the previous pass, the lines whose @in files changed since
+//then and the lines after a label that ran again. cd lines always run and
+//every pass starts in the directory msh was started in, so each line runs
+//in the directory it would run in from the top. the '>' files lines write
+//do not start a pass; a line with one of them as @in runs again if it was
+//rewritten after the previous pass ended
+#define WATCH_DEBOUNCE_MS 100 //a pass starts once changes stop for this long
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_ATTRIB | IN_CREATE | IN_DELETE)
+
+struct watch_dir
+{
+  int wd;
+  char *path;
+};
+
+static struct
+{
+  int fd;
+  struct watch_dir *dirs;
+  int dir_count;
+  struct label_map files; //absolute paths of the watched files
+  struct label_map written; //absolute paths of the '>' files of lines that ran
+} watcher;
+
+#define WATCH_PATH_SIZE (PATH_MAX + NAME_MAX + 2)
+
+//makes path absolute through the real path of its directory, which is
+//stored in real. returns -1 if the directory does not exist
+static int watch_full_path(const char *path, char *real, char *full)
+{
+  char *dir = strdup(path);
+  char *slash = strrchr(dir, '/');
+  const char *name = slash != NULL ? slash + 1 : path;
+
+  if (slash == NULL)
+  {
+    strcpy(dir, ".");
+  }
+  else if (slash == dir)
+  {
+    dir[1] = '\0';
+  }
+  else
+  {
+    *slash = '\0';
+  }
+  int result = realpath(dir, real) != NULL ? 0 : -1;
+  if (result == 0)
+  {
+    snprintf(full, WATCH_PATH_SIZE, "%s/%s", strcmp(real, "/") == 0 ? "" : real, name); //name may point into dir
+  }
+  free(dir);
+  return result;
+}
+
+//directories are watched instead of the files themselves, editors tend
+//to replace a file rather than write to it
+static void watch_file(const char *path)
+{
+  char real[PATH_MAX], full[WATCH_PATH_SIZE];
+  int wd = watch_full_path(path, real, full) == 0 ? inotify_add_watch(watcher.fd, real, WATCH_EVENTS) : -1;
+  if (wd < 0)
+  {
+    return;
+  }
+
+  int known = 0;
+  for (int i = 0; i < watcher.dir_count && !known; i++)
+  {
+    known = watcher.dirs[i].wd == wd;
+  }
+  if (!known)
+  {
+    watcher.dirs = realloc(watcher.dirs, (watcher.dir_count + 1) * sizeof(struct watch_dir));
+    watcher.dirs[watcher.dir_count].wd = wd;
+    watcher.dirs[watcher.dir_count].path = strdup(real);
+    watcher.dir_count++;
+  }
+  label_map_put(&watcher.files, full, 1);
+}
+
+//reads the pending events, returns 1 if one of them is about a watched
+//file that no line writes
+static int watch_read_events(void)
+{
+  char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t len = read(watcher.fd, buffer, sizeof(buffer));
+  int changed = 0;
+
+  for (char *p = buffer; len > 0 && p < buffer + len; )
+  {
+    struct inotify_event *event = (struct inotify_event *)p;
+    p += sizeof(struct inotify_event) + event->len;
+    for (int i = 0; i < watcher.dir_count && event->len > 0; i++)
+    {
+      if (watcher.dirs[i].wd == event->wd)
+      {
+        char full[WATCH_PATH_SIZE];
+        snprintf(full, sizeof(full), "%s/%s", strcmp(watcher.dirs[i].path, "/") == 0 ? "" : watcher.dirs[i].path,
+                 event->name);
+        changed |= label_map_find(&watcher.files, full) != NULL && label_map_find(&watcher.written, full) == NULL;
+      }
+    }
+  }
+  return changed;
+}
+
+//blocks until a watched file changes and then until things are quiet
+static void watch_wait(void)
+{
+  struct pollfd pfd = {watcher.fd, POLLIN, 0};
+  int changed = 0;
+  while (!changed)
+  {
+    if (poll(&pfd, 1, -1) > 0)
+    {
+      changed = watch_read_events();
+    }
+  }
+  while (poll(&pfd, 1, WATCH_DEBOUNCE_MS) > 0)
+  {
+    watch_read_events();
+  }
+}
+
+//whether an @in file changed since the previous pass started, or for files
+//lines write, after it ended
+static int inputs_changed_since(struct command *cmd, struct timespec since, struct timespec until)
+{
+  struct stat st;
+  char real[PATH_MAX], full[WATCH_PATH_SIZE];
+  for (int i = 0; i < cmd->input_count; i++)
+  {
+    if (stat(cmd->input[i], &st) != 0)
+    {
+      return 1;
+    }
+    if (watch_full_path(cmd->input[i], real, full) == 0 && label_map_find(&watcher.written, full) != NULL
+            ? older(until, st.st_mtim)
+            : !older(st.st_mtim, since))
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void free_label_map(struct label_map *map)
+{
+  for (size_t i = 0; i < map->capacity; i++)
+  {
+    free(map->keys[i]);
+  }
+  free(map->keys);
+  free(map->values);
+  memset(map, 0, sizeof(*map));
+}
+
+//runs one pass over the batch file. previous holds how often every line
+//text occurred in the previous pass and is replaced with this pass's
+static void watch_pass(const char *batch_path, const char *start_dir, struct label_map *previous,
+                       struct timespec since, struct timespec until, int first)
+{
+  char command_string[MAX_COMMAND_SIZE];
+  struct label_map current = {0};
+  struct label_map rerun = {0}; //labels of lines run in this pass
+
+  change_directory(start_dir);
+  watch_file(batch_path);
+  FILE *batch_file = fopen(batch_path, "re");
+  if (batch_file == NULL) //being replaced, the rename is another event
+  {
+    return;
+  }
+
+  while (fgets(command_string, MAX_COMMAND_SIZE, batch_file))
+  {
+    command_string[strcspn(command_string, "\n")] = '\0'; //replaces newline with null terminator
+
+    struct command cmd;
+    if (parse_command(command_string, &cmd) == 0) //skip empty and blank lines
+    {
+      continue;
+    }
+    int *seen = label_map_find(&current, command_string);
+    label_map_put(&current, command_string, seen != NULL ? *seen + 1 : 1);
+    int *old = label_map_find(previous, command_string);
+    int run = first || old == NULL || *old == 0 || strcmp(cmd.token[0], "cd") == 0 ||
+              inputs_changed_since(&cmd, since, until);
+    if (old != NULL && *old > 0)
+    {
+      (*old)--; //every old copy of a line accounts for one new copy
+    }
+    for (int i = 0; i < cmd.after_count && !run; i++)
+    {
+      run = label_map_find(&rerun, cmd.after[i]) != NULL;
+    }
+    for (int i = 0; i < cmd.input_count; i++)
+    {
+      watch_file(cmd.input[i]);
+    }
+
+    if (cmd.token_count == 1 && (strcmp(cmd.token[0], "exit") == 0 || strcmp(cmd.token[0], "quit") == 0))
+    {
+      free_command(&cmd);
+      break; //ends the pass, not msh
+    }
+    if (run)
+    {
+      if (!is_builtin(cmd.token[0]))
+      {
+        resolve_parsed_command(&cmd);
+      }
+      char real[PATH_MAX], full[WATCH_PATH_SIZE];
+      if (cmd.redirect != NULL && watch_full_path(cmd.redirect, real, full) == 0)
+      {
+        label_map_put(&watcher.written, full, 1);
+      }
+      run_line(&cmd);
+      if (cmd.label != NULL)
+      {
+        label_map_put(&rerun, cmd.label, 1);
+      }
+    }
+    free_command(&cmd);
+  }
+  fclose(batch_file);
+
+  free_label_map(previous);
+  *previous = current;
+  free_label_map(&rerun);
+}
+
+//returns only if watching cannot be set up
+static int run_watch(const char *batch_path)
+{
+  char start_dir[MAX_PATH];
+  struct label_map previous = {0};
+  struct timespec since = {0, 0}; //when the previous pass started
+  struct timespec until = {0, 0}; //and ended
+
+  watcher.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (watcher.fd < 0 || getcwd(start_dir, sizeof(start_dir)) == NULL || access(batch_path, R_OK) != 0)
+  {
+    return -1;
+  }
+  for (int first = 1; ; first = 0)
+  {
+    struct timespec start;
+    clock_gettime(CLOCK_REALTIME_COARSE, &start); //the clock file times are taken from
+    watch_pass(batch_path, start_dir, &previous, since, until, first);
+    since = start; //an input written during the pass may have been read before the change
+    clock_gettime(CLOCK_REALTIME_COARSE, &until);
+    watch_wait();
+  }
+}
+
+//batch input is read, tokenized, checked and resolved by a reader thread
+//running ahead of the executor. parsed commands are handed over through a
+//bounded single-producer/single-consumer ring, so the next command is ready
+//to spawn as soon as the current child exits. head and tail only ever grow
+//and double as futex words for the rare case that one side has to wait
+static struct command batch_queue[BATCH_LOOKAHEAD];
+static atomic_uint batch_queue_head; //next slot the executor takes
+static atomic_uint batch_queue_tail; //next slot the reader fills
+
+//shared futexes are needed for words living in memory shared with other processes
+static void futex_wait(atomic_uint *addr, unsigned int expected, int shared)
+{
+  syscall(SYS_futex, addr, shared ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static void futex_wake(atomic_uint *addr, int shared)
+{
+  syscall(SYS_futex, addr, shared ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+//reserves the next free slot for the reader, waiting while the ring is full
+static struct command *batch_queue_reserve(void)
+{
+  unsigned int tail = atomic_load_explicit(&batch_queue_tail, memory_order_relaxed);
+  unsigned int head;
+  while (tail - (head = atomic_load_explicit(&batch_queue_head, memory_order_acquire)) == BATCH_LOOKAHEAD)
+  {
+    futex_wait(&batch_queue_head, head, 0);
+  }
+  return &batch_queue[tail % BATCH_LOOKAHEAD];
+}
+
+static void batch_queue_publish(void)
+{
+  atomic_fetch_add_explicit(&batch_queue_tail, 1, memory_order_release);
+  futex_wake(&batch_queue_tail, 0);
+}
+
+//returns the oldest parsed command, waiting while the ring is empty
+static struct command *batch_queue_peek(void)
+{
+  unsigned int head = atomic_load_explicit(&batch_queue_head, memory_order_relaxed);
+  unsigned int tail;
+  while ((tail = atomic_load_explicit(&batch_queue_tail, memory_order_acquire)) == head)
+  {
+    futex_wait(&batch_queue_tail, tail, 0);
+  }
+  return &batch_queue[head % BATCH_LOOKAHEAD];
+}
+
+static void batch_queue_release(void)
+{
+  atomic_fetch_add_explicit(&batch_queue_head, 1, memory_order_release);
+  futex_wake(&batch_queue_head, 0);
+}
+
+static void *batch_reader(void *arg)
+{
+  FILE *batch_file = arg;
+  char command_string[MAX_COMMAND_SIZE];
+  int line_number = 0;
+  int starts_line = 1; //the previous chunk ended with its newline
+
+  while (fgets(command_string, MAX_COMMAND_SIZE, batch_file))
+  {
+    if (starts_line)
+    {
+      line_number++; //the rest of an overlong line keeps the line's number
+    }
+    starts_line = command_string[strcspn(command_string, "\n")] == '\n';
+    command_string[strcspn(command_string, "\n")] = '\0'; //replaces newline with null terminator
+
+    struct command *cmd = batch_queue_reserve();
+    if (parse_command(command_string, cmd) == 0) //skip empty and blank lines
+    {
+      continue;
+    }
+    cmd->line_number = line_number;
+    if (!is_builtin(cmd->token[0]))
+    {
+      resolve_parsed_command(cmd);
+      if (cmd->found && !cmd->syntax_error)
+      {
+        prefetch_command(cmd->token[0], cmd->cmd_path);
+      }
+    }
+    batch_queue_publish();
+  }
+
+  struct command *cmd = batch_queue_reserve();
+  memset(cmd, 0, sizeof(*cmd));
+  cmd->eof = 1;
+  batch_queue_publish();
+  return NULL;
+}
+
+//compiled batch plans (.mshc)
+//a plan is the result of tokenizing, checking and resolving every line of a
+//batch file, so running it only has to walk the records and spawn.
+//
+//  header: "MSHC", u32 version, u64 hash of the source file, u32 record count, u32 zero
+//  record: u32 size, u8 kind, u8 argc, u16 zero, then length prefixed strings
+//          (u16 length, bytes, NUL): resolved path, redirect file, argv[0..argc-1]
+//
+//records are padded to 8 bytes. the strings are NUL terminated inside the
+//mapping, so argv can point straight into it. an empty path means the command
+//is resolved when the plan runs; so are "./" paths since they depend on the cwd.
+//an empty redirect means no redirection
+#define PLAN_MAGIC "MSHC"
+#define PLAN_VERSION 1
+#define PLAN_SUFFIX ".mshc"
+
+enum plan_kind
+{
+  PLAN_RUN, //external command
+  PLAN_CD, //cd built-in, argv[1] is the directory
+  PLAN_EXIT, //exit or quit built-in
+  PLAN_ERROR //line that only reports an error when run
+};
+
+struct plan_header
+{
+  char magic[4];
+  uint32_t version;
+  uint64_t source_hash;
+  uint32_t count;
+  uint32_t reserved;
+};
+
+struct plan_record
+{
+  uint32_t size;
+  uint8_t kind;
+  uint8_t argc;
+  uint16_t reserved;
+};
+
+static void plan_put_string(FILE *out, const char *str, size_t *size)
+{
+  uint16_t len = str ? strlen(str) : 0;
+  fwrite(&len, sizeof(len), 1, out);
+  fwrite(str ? str : "", 1, len + 1, out);
+  *size += sizeof(len) + len + 1;
+}
+
+//writes the record for one parsed line
+static void plan_put_command(FILE *out, struct command *cmd)
+{
+  struct plan_record rec = {0, PLAN_RUN, 0, 0};
+  const char *path = NULL;
+  char **args = cmd->argv;
+
+  if (strcmp(cmd->token[0], "exit") == 0 || strcmp(cmd->token[0], "quit") == 0)
+  {
+    rec.kind = cmd->token_count == 1 ? PLAN_EXIT : PLAN_ERROR;
+  }
+  else if (strcmp(cmd->token[0], "cd") == 0)
+  {
+    rec.kind = cmd->token_count == 2 ? PLAN_CD : PLAN_ERROR;
+    args = cmd->token;
+  }
+  else if (cmd->syntax_error || cmd->argv[0] == NULL) //bad redirection or nothing before '>'
+  {
+    rec.kind = PLAN_ERROR;
+  }
+  else if (cmd->found && strncmp(cmd->cmd_path, "./", 2) != 0)
+  {
+    path = cmd->cmd_path;
+  }
+  if (rec.kind == PLAN_ERROR || rec.kind == PLAN_EXIT)
+  {
+    args = NULL;
+  }
+  while (args != NULL && args[rec.argc] != NULL)
+  {
+    rec.argc++;
+  }
+
+  size_t size = sizeof(rec);
+  long start = ftell(out);
+  fwrite(&rec, sizeof(rec), 1, out);
+  plan_put_string(out, path, &size);
+  plan_put_string(out, rec.kind == PLAN_RUN ? cmd->redirect : NULL, &size);
+  for (int i = 0; i < rec.argc; i++)
+  {
+    plan_put_string(out, args[i], &size);
+  }
+  static const char padding[8];
+  fwrite(padding, 1, (8 - size % 8) % 8, out);
+  size += (8 - size % 8) % 8;
+
+  //patch in the final size
+  rec.size = size;
+  fseek(out, start, SEEK_SET);
+  fwrite(&rec, sizeof(rec), 1, out);
+  fseek(out, 0, SEEK_END);
+}
+
+//--compile: turns a batch file into a plan, written next to a temporary name
+//and renamed into place so a running msh never sees a half written plan
+static int compile_batch_file(const char *source, const char *output)
+{
+  size_t size;
+  char *text = map_file(source, &size);
+  if (text == NULL)
+  {
+    return -1;
+  }
+
+  char tmp_path[MAX_PATH];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp%d", output, (int)getpid());
+  FILE *out = fopen(tmp_path, "we");
+  if (out == NULL)
+  {
+    munmap(text, size);
+    return -1;
+  }
+
+  struct plan_header header = {PLAN_MAGIC, PLAN_VERSION, hash_bytes(0, text, size), 0, 0};
+  fwrite(&header, sizeof(header), 1, out);
+
+  //split into lines exactly the way fgets() would in batch mode
+  char command_string[MAX_COMMAND_SIZE];
+  size_t pos = 0;
+  while (pos < size)
+  {
+    size_t len = 0;
+    while (pos + len < size && len < MAX_COMMAND_SIZE - 1 && text[pos + len] != '\n')
+    {
+      len++;
+    }
+    if (pos + len < size && len < MAX_COMMAND_SIZE - 1 && text[pos + len] == '\n')
+    {
+      len++;
+    }
+    memcpy(command_string, text + pos, len);
+    command_string[len] = '\0';
+    pos += len;
+
+    command_string[strcspn(command_string, "\n")] = '\0'; //replaces newline with null terminator
+
+    struct command cmd;
+    if (parse_command(command_string, &cmd) == 0) //nothing to record for blank lines
+    {
+      continue;
+    }
+    if (cmd.annotation_count > 0) //plans have no room for annotations
+    {
+      free_command(&cmd);
+      fclose(out);
+      unlink(tmp_path);
+      munmap(text, size);
+      return -1;
+    }
+    if (!is_builtin(cmd.token[0]))
+    {
+      resolve_parsed_command(&cmd);
+    }
+    plan_put_command(out, &cmd);
+    header.count++;
+    free_command(&cmd);
+  }
+  munmap(text, size);
+
+  fseek(out, 0, SEEK_SET);
+  fwrite(&header, sizeof(header), 1, out);
+  if (fclose(out) != 0 || rename(tmp_path, output) != 0)
+  {
+    unlink(tmp_path);
+    return -1;
+  }
+  return 0;
+}
+
+//returns the plan header if the mapping holds a plan this msh understands
+static struct plan_header *plan_header(void *map, size_t size)
+{
+  struct plan_header *header = map;
+  if (map == NULL || size < sizeof(*header) || memcmp(header->magic, PLAN_MAGIC, 4) != 0 ||
+      header->version != PLAN_VERSION)
+  {
+    return NULL;
+  }
+  return header;
+}
+
+//reads one length prefixed string of a record, returns NULL if it runs past the end
+static char *plan_get_string(char **pos, char *end)
+{
+  uint16_t len;
+  if (end - *pos < (long)sizeof(len))
+  {
+    return NULL;
+  }
+  memcpy(&len, *pos, sizeof(len));
+  char *str = *pos + sizeof(len);
+  if (end - str < len + 1 || str[len] != '\0')
+  {
+    return NULL;
+  }
+  *pos = str + len + 1;
+  return str;
+}
+
+//runs every record of a mapped plan
+static void run_plan(char *map, size_t size)
+{
+  struct plan_header *header = plan_header(map, size);
+  char *pos = map + sizeof(*header);
+  char *end = map + size;
+
+  for (uint32_t n = 0; header != NULL && n < header->count; n++)
+  {
+    struct plan_record rec;
+    if (end - pos < (long)sizeof(rec))
+    {
+      break;
+    }
+    memcpy(&rec, pos, sizeof(rec));
+    if (rec.size < sizeof(rec) || rec.size > end - pos || rec.argc >= MAX_NUM_ARGUMENTS)
+    {
+      break;
+    }
+
+    char *rec_end = pos + rec.size;
+    char *field = pos + sizeof(rec);
+    char *path = plan_get_string(&field, rec_end);
+    char *redirect = plan_get_string(&field, rec_end);
+    char *args[MAX_NUM_ARGUMENTS];
+    int argc;
+    for (argc = 0; argc < rec.argc; argc++)
+    {
+      if ((args[argc] = plan_get_string(&field, rec_end)) == NULL)
+      {
+        break;
+      }
+    }
+    args[argc] = NULL;
+    pos = rec_end;
+    if (path == NULL || redirect == NULL || argc != rec.argc)
+    {
+      break;
+    }
+
+    int status = STATUS_ERROR;
+    if (rec.kind == PLAN_ERROR)
+    {
+      print_error();
+    }
+    else if (rec.kind == PLAN_EXIT)
+    {
+      exit(0);
+    }
+    else if (rec.kind == PLAN_CD && argc == 2)
+    {
+      status = change_directory(args[1]) == 0 ? 0 : STATUS_ERROR;
+    }
+    else if (rec.kind == PLAN_RUN && argc > 0)
+    {
+      char cmd_path[MAX_PATH];
+      unsigned int generation;
+      //the executable recorded at compile time may have moved since
+      if (path[0] == '\0' || access(path, X_OK) != 0)
+      {
+        path = cmd_path;
+        if (!resolve_command(args[0], cmd_path, sizeof(cmd_path), &generation))
+        {
+          print_error();
+          count_status(status);
+          continue;
+        }
+      }
+      status = spawn_command(path, args, redirect[0] ? redirect : NULL, NULL);
+    }
+    count_status(status);
+  }
+}
+
+//finds a plan for a batch file: either the file is a plan itself, or a
+//"<file>.mshc" compiled from exactly this source exists next to it.
+//returns the mapped plan or NULL to run the batch file as text
+static char *find_plan(const char *batch_path, size_t *plan_size)
+{
+  size_t size;
+  char *map = map_file(batch_path, &size);
+  if (map == NULL)
+  {
+    return NULL;
+  }
+  if (plan_header(map, size) != NULL)
+  {
+    *plan_size = size;
+    return map;
+  }
+
+  char plan_path[MAX_PATH];
+  snprintf(plan_path, sizeof(plan_path), "%s%s", batch_path, PLAN_SUFFIX);
+  char *plan = NULL;
+  if (access(plan_path, R_OK) == 0)
+  {
+    plan = map_file(plan_path, plan_size);
+    struct plan_header *header = plan_header(plan, *plan_size);
+    if (plan != NULL && (header == NULL || header->source_hash != hash_bytes(0, map, size)))
+    {
+      munmap(plan, *plan_size); //stale plan, the source changed since it was compiled
+      plan = NULL;
+    }
+  }
+  munmap(map, size);
+  return plan;
+}
+
+//-0 input: every argument is terminated by a NUL byte and an empty argument
+//ends the command, so arguments may contain any other character including
+//whitespace. input is read in large chunks and the arguments are used in
+//place without going through the tokenizer. a lone ">" argument still
+//redirects, exactly like in a batch file
+#define NUL_READ_SIZE 65536
+
+//runs one command given as a ready made NULL terminated argument list,
+//which may be cut at its '>'. returns its exit code or STATUS_ERROR
+static int run_argv(char **args, int count)
+{
+  int status;
+  if (run_builtin(args, count, &status))
+  {
+    return status;
+  }
+
+  char *redirect;
+  char cmd_path[MAX_PATH];
+  unsigned int generation;
+  if (split_redirect(args, &redirect) != 0 || args[0] == NULL ||
+      !resolve_command(args[0], cmd_path, sizeof(cmd_path), &generation))
+  {
+    print_error();
+    return STATUS_ERROR;
+  }
+  return spawn_command(cmd_path, args, redirect, NULL);
+}
+
+//runs one command whose arguments start at the given buffer offsets
+static void run_nul_command(char *buf, size_t *offsets, int count)
+{
+  char **args = malloc((count + 1) * sizeof(char*));
+  for (int i = 0; i < count; i++)
+  {
+    args[i] = buf + offsets[i];
+  }
+  args[count] = NULL;
+
+  run_argv(args, count);
+  free(args);
+}
+
+static void run_nul_input(int fd)
+{
+  size_t size = NUL_READ_SIZE;
+  char *buf = malloc(size);
+  size_t len = 0; //bytes in buf
+  size_t start = 0; //first byte of the command being collected
+  size_t pos = 0; //first byte not scanned yet
+  size_t *offsets = NULL; //argument offsets of the command being collected
+  int count = 0;
+  int capacity = 0;
+  int eof = 0;
+
+  while (!eof || start < len)
+  {
+    char *nul = memchr(buf + pos, '\0', len - pos);
+    if (nul == NULL && !eof)
+    {
+      //out of complete arguments: slide the pending command to the front,
+      //grow the buffer if it alone fills it, and read more
+      if (start > 0)
+      {
+        memmove(buf, buf + start, len - start);
+        for (int i = 0; i < count; i++)
+        {
+          offsets[i] -= start;
+        }
+        len -= start;
+        pos -= start;
+        start = 0;
+      }
+      if (size - len < NUL_READ_SIZE / 2)
+      {
+        size *= 2;
+        buf = realloc(buf, size);
+      }
+      ssize_t n = read(fd, buf + len, size - len);
+      if (n < 0 && errno == EINTR)
+      {
+        continue;
+      }
+      if (n <= 0)
+      {
+        eof = 1;
+        if (len > pos) //unterminated last argument
+        {
+          buf[len++] = '\0';
+        }
+      }
+      else
+      {
+        len += n;
+      }
+      continue;
+    }
+
+    size_t end = nul ? (size_t)(nul - buf) : len;
+    if (end > pos) //one more argument
+    {
+      if (count == capacity)
+      {
+        capacity = capacity ? capacity * 2 : 16;
+        offsets = realloc(offsets, capacity * sizeof(size_t));
+      }
+      offsets[count++] = pos;
+    }
+    if (end == pos || nul == NULL) //empty argument or end of input: run the command
+    {
+      if (count > 0)
+      {
+        run_nul_command(buf, offsets, count);
+      }
+      count = 0;
+      start = nul ? end + 1 : len;
+    }
+    pos = nul ? end + 1 : len;
+  }
+
+  free(offsets);
+  free(buf);
+}
+
+//--ring NAME: commands are submitted through a POSIX shared memory object
+//(shm_open NAME) instead of a file, so a controller process can hand argv
+//to msh without files, pipes or parsing. the object holds
+//
+//  struct ring_header
+//  slot_count submission slots of slot_size bytes: struct ring_submission
+//      followed by argc NUL terminated strings (a ">" string redirects)
+//  slot_count completion records: struct ring_completion
+//
+//the four indices only ever grow, a slot or record is index % slot_count.
+//the producer fills slot sub_tail, bumps sub_tail and FUTEX_WAKEs it; msh
+//runs slot sub_head, appends a completion at done_tail (waking done_tail)
+//and only then bumps sub_head (waking sub_head), so the argv strings can be
+//used in place. the producer consumes completions by bumping done_head and
+//waking it. setting closed (and waking sub_tail) makes msh exit once the
+//ring is empty. the futexes are process-shared. the producer creates,
+//sizes and finally unlinks the object, msh only attaches to it
+#define RING_MAGIC "MSHRING"
+#define RING_VERSION 1
+#define RING_SPIN 2000 //empty polls before sleeping on the futex
+
+struct ring_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t slot_count;
+  uint32_t slot_size;
+  atomic_uint closed;
+  //each index on its own cache line, they are written by different processes
+  atomic_uint sub_head __attribute__((aligned(64)));
+  atomic_uint sub_tail __attribute__((aligned(64)));
+  atomic_uint done_head __attribute__((aligned(64)));
+  atomic_uint done_tail __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
+
+struct ring_submission
+{
+  uint64_t tag; //copied to the completion
+  uint32_t argc;
+  uint32_t len; //bytes of strings following this header
+};
+
+struct ring_completion
+{
+  uint64_t tag;
+  int32_t status; //exit code, 128 + signal, or STATUS_ERROR
+  uint32_t reserved;
+};
+
+static size_t ring_size(uint32_t slot_count, uint32_t slot_size)
+{
+  return sizeof(struct ring_header) + (size_t)slot_count * slot_size +
+         (size_t)slot_count * sizeof(struct ring_completion);
+}
+
+//opens the ring and maps it, returns NULL on failure
+static struct ring_header *attach_ring(const char *name, size_t *size)
+{
+  int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+  if (fd < 0)
+  {
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+  {
+    close(fd);
+    return NULL;
+  }
+
+  struct ring_header *ring = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ring == MAP_FAILED)
+  {
+    return NULL;
+  }
+  *size = st.st_size;
+
+  if ((size_t)st.st_size < sizeof(*ring) || memcmp(ring->magic, RING_MAGIC, sizeof(ring->magic)) != 0 ||
+      ring->version != RING_VERSION || ring->slot_count == 0 ||
+      ring->slot_size <= sizeof(struct ring_submission) ||
+      ring_size(ring->slot_count, ring->slot_size) > (size_t)st.st_size)
+  {
+    munmap(ring, st.st_size);
+    return NULL;
+  }
+  return ring;
+}
+
+//splits a submission slot into argv, pointing into the slot itself
+//returns the argument count or -1 if the slot is malformed
+static int ring_argv(struct ring_header *ring, struct ring_submission *sub, char ***args)
+{
+  char *data = (char*)(sub + 1);
+  if (sub->len > ring->slot_size - sizeof(*sub) || sub->argc == 0 || sub->argc > sub->len)
+  {
+    return -1;
+  }
+  *args = malloc((sub->argc + 1) * sizeof(char*));
+  uint32_t pos = 0;
+  for (uint32_t i = 0; i < sub->argc; i++)
+  {
+    char *nul = pos < sub->len ? memchr(data + pos, '\0', sub->len - pos) : NULL;
+    if (nul == NULL)
+    {
+      free(*args);
+      return -1;
+    }
+    (*args)[i] = data + pos;
+    pos = nul - data + 1;
+  }
+  (*args)[sub->argc] = NULL;
+  return sub->argc;
+}
+
+static void run_ring(struct ring_header *ring)
+{
+  char *slots = (char*)(ring + 1);
+  struct ring_completion *done = (struct ring_completion*)(slots + (size_t)ring->slot_count * ring->slot_size);
+
+  while (1)
+  {
+    unsigned int head = atomic_load_explicit(&ring->sub_head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&ring->sub_tail, memory_order_acquire);
+    for (int spin = 0; tail == head && spin < RING_SPIN; spin++)
+    {
+      tail = atomic_load_explicit(&ring->sub_tail, memory_order_acquire);
+    }
+    if (tail == head)
+    {
+      if (atomic_load_explicit(&ring->closed, memory_order_acquire))
+      {
+        break;
+      }
+      futex_wait(&ring->sub_tail, tail, 1);
+      continue;
+    }
+
+    struct ring_submission *sub = (struct ring_submission*)(slots + (size_t)(head % ring->slot_count) * ring->slot_size);
+    char **args;
+    int argc = ring_argv(ring, sub, &args);
+    int status = STATUS_ERROR;
+    int leave = 0;
+    if (argc < 0)
+    {
+      print_error();
+    }
+    else
+    {
+      //exit ends msh, but only after the producer has been told
+      leave = (strcmp(args[0], "exit") == 0 || strcmp(args[0], "quit") == 0) && argc == 1;
+      status = leave ? 0 : run_argv(args, argc);
+      free(args);
+    }
+
+    //wait for room in the completion ring, then report
+    unsigned int done_tail = atomic_load_explicit(&ring->done_tail, memory_order_relaxed);
+    unsigned int done_head;
+    while (done_tail - (done_head = atomic_load_explicit(&ring->done_head, memory_order_acquire)) >= ring->slot_count)
+    {
+      futex_wait(&ring->done_head, done_head, 1);
+    }
+    done[done_tail % ring->slot_count].tag = sub->tag;
+    done[done_tail % ring->slot_count].status = status;
+    atomic_store_explicit(&ring->done_tail, done_tail + 1, memory_order_release);
+    futex_wake(&ring->done_tail, 1);
+
+    atomic_store_explicit(&ring->sub_head, head + 1, memory_order_release);
+    futex_wake(&ring->sub_head, 1);
+
+    if (leave)
+    {
+      break;
+    }
+  }
+}
+
+//--serve PATH: msh listens on a Unix stream socket and every connection is
+//an independent session with its own cwd and history. one epoll loop
+//multiplexes the listening socket, the connections, the stdout/stderr pipes
+//of the running commands and their pidfds, so a slow command in one session
+//never holds up another.
+//
+//clients send command lines terminated by '\n', using the batch syntax.
+//msh answers with frames, each a header line that may be followed by data:
+//  "o <len>\n" + len bytes   output the command wrote to stdout
+//  "e <len>\n" + len bytes   output the command wrote to stderr
+//  "x <status>\n"            the command finished (exit code, 128 + signal,
+//                            STATUS_TIMEOUT or STATUS_ERROR)
+//a session runs one command at a time, lines sent meanwhile are queued.
+//"history" lists the lines of the session, exit/quit closes the session.
+//@timeout and --timeout apply as in a batch; @after and @retry lines are
+//refused, a session has no labels and no one to wait out a backoff
+#define SESSION_INPUT_SIZE 4096 //queued, not yet executed input of a session
+#define SESSION_HISTORY 100 //lines remembered per session
+#define SESSION_OUTPUT_HIGH 65536 //stop reading a child's pipes above this much unsent output
+#define SERVE_MAX_EVENTS 64
+
+enum source_kind
+{
+  SOURCE_LISTEN,
+  SOURCE_SIGNAL,
+  SOURCE_CONN,
+  SOURCE_STDOUT,
+  SOURCE_STDERR,
+  SOURCE_CHILD,
+  SOURCE_TIMER
+};
+
+struct session;
+
+//what an epoll event refers to
+struct source
+{
+  enum source_kind kind;
+  struct session *session;
+};
+
+struct session
+{
+  int fd; //connection, -1 once the client is gone
+  struct source conn_src, out_src, err_src, child_src, timer_src;
+  char in[SESSION_INPUT_SIZE];
+  size_t in_len;
+  int in_eof; //client shut down its side or exit was run
+  char *out; //frames not sent yet
+  size_t out_len;
+  size_t out_cap;
+  int cwd_fd; //O_PATH descriptor of the session's working directory
+  char *history[SESSION_HISTORY];
+  int history_count; //lines ever added, the last SESSION_HISTORY are kept
+  pid_t pid; //running command or 0
+  int pidfd;
+  struct child_timer timer; //timeout of the running command
+  int out_pipe; //read ends of the command's stdout/stderr, -1 when closed
+  int err_pipe;
+  int status; //exit code of the running command once it is reaped
+  int reaped;
+};
+
+static int serve_epoll = -1;
+
+static void serve_watch(int op, int fd, uint32_t events, struct source *src)
+{
+  struct epoll_event ev = {.events = events, .data.ptr = src};
+  epoll_ctl(serve_epoll, op, fd, &ev);
+}
+
+//queues a frame for the client, nothing is queued once it is gone
+static void session_frame(struct session *s, char kind, const char *data, size_t len, int status)
+{
+  char header[32];
+  int header_len = kind == 'x' ? snprintf(header, sizeof(header), "x %d\n", status)
+                               : snprintf(header, sizeof(header), "%c %zu\n", kind, len);
+  if (s->fd < 0)
+  {
+    return;
+  }
+  if (s->out_len + header_len + len > s->out_cap)
+  {
+    s->out_cap = (s->out_len + header_len + len) * 2;
+    s->out = realloc(s->out, s->out_cap);
+  }
+  memcpy(s->out + s->out_len, header, header_len);
+  memcpy(s->out + s->out_len + header_len, data, len);
+  s->out_len += header_len + len;
+}
+
+static void session_error(struct session *s)
+{
+  session_frame(s, 'e', error_message, strlen(error_message), 0);
+}
+
+//sends as much queued output as the socket takes without blocking
+static void session_flush(struct session *s)
+{
+  size_t sent = 0;
+  while (s->fd >= 0 && sent < s->out_len)
+  {
+    ssize_t n = send(s->fd, s->out + sent, s->out_len - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n > 0)
+    {
+      sent += n;
+    }
+    else if (n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+      break;
+    }
+    else //client went away, its output is dropped from now on
+    {
+      close(s->fd);
+      s->fd = -1;
+      s->in_eof = 1;
+      sent = s->out_len;
+    }
+  }
+  memmove(s->out, s->out + sent, s->out_len - sent);
+  s->out_len -= sent;
+}
+
+//picks the epoll events each descriptor of the session currently needs:
+//input only while there is room to queue it, pipes only while the client
+//keeps up with the output
+static void session_update(struct session *s)
+{
+  if (s->fd >= 0)
+  {
+    uint32_t events = 0;
+    if (!s->in_eof && s->in_len < sizeof(s->in))
+    {
+      events |= EPOLLIN;
+    }
+    if (s->out_len > 0)
+    {
+      events |= EPOLLOUT;
+    }
+    serve_watch(EPOLL_CTL_MOD, s->fd, events, &s->conn_src);
+  }
+  uint32_t pipe_events = s->out_len < SESSION_OUTPUT_HIGH ? EPOLLIN : 0;
+  if (s->out_pipe >= 0)
+  {
+    serve_watch(EPOLL_CTL_MOD, s->out_pipe, pipe_events, &s->out_src);
+  }
+  if (s->err_pipe >= 0)
+  {
+    serve_watch(EPOLL_CTL_MOD, s->err_pipe, pipe_events, &s->err_src);
+  }
+}
+
+static void session_destroy(struct session *s)
+{
+  if (s->fd >= 0)
+  {
+    close(s->fd);
+  }
+  close(s->cwd_fd);
+  int kept = s->history_count < SESSION_HISTORY ? s->history_count : SESSION_HISTORY;
+  for (int i = 0; i < kept; i++)
+  {
+    free(s->history[i]);
+  }
+  free(s->out);
+  free(s);
+}
+
+static void session_remember(struct session *s, const char *line)
+{
+  int slot = s->history_count % SESSION_HISTORY;
+  if (s->history_count >= SESSION_HISTORY)
+  {
+    free(s->history[slot]);
+  }
+  s->history[slot] = strdup(line);
+  s->history_count++;
+}
+
+//cd inside a session only changes the session's cwd. the session keeps
+//the directory itself, so it stays in it even if the directory is renamed
+static int session_cd(struct session *s, const char *dir)
+{
+  int fd = open_directory_at(s->cwd_fd, dir);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  close(s->cwd_fd);
+  s->cwd_fd = fd;
+  return 0;
+}
+
+//resolves a command for a session: the absolute search directories come
+//from the shared lookup cache, "./" means the session's cwd
+static int session_resolve(struct session *s, const char *name, char *cmd_path, size_t size)
+{
+  unsigned int generation;
+  if (resolve_command(name, cmd_path, size, &generation) && strncmp(cmd_path, "./", 2) != 0)
+  {
+    return 1;
+  }
+  snprintf(cmd_path, size, "./%s", name); //the child enters the session's cwd first
+  return faccessat(s->cwd_fd, name, X_OK, 0) == 0;
+}
+
+//starts a command for a session with its stdout and stderr on pipes
+//returns 0, or -1 if nothing could be started
+static int session_spawn(struct session *s, struct command *cmd)
+{
+  int out[2], err[2];
+  if (pipe2(out, O_CLOEXEC) != 0)
+  {
+    return -1;
+  }
+  if (pipe2(err, O_CLOEXEC) != 0)
+  {
+    close(out[0]);
+    close(out[1]);
+    return -1;
+  }
+
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    dup2(out[1], STDOUT_FILENO);
+    dup2(err[1], STDERR_FILENO);
+    if (fchdir(s->cwd_fd) != 0)
+    {
+      print_error();
+      _exit(1);
+    }
+    exec_child(cmd->cmd_path, cmd->argv, cmd->redirect, &cmd->setup);
+  }
+  close(out[1]);
+  close(err[1]);
+  if (pid > 0 && cmd->setup.timeout > 0)
+  {
+    setpgid(pid, pid);
+  }
+  int pidfd = pid > 0 ? pidfd_open(pid, 0) : -1;
+  if (pidfd < 0)
+  {
+    if (pid > 0)
+    {
+      kill(pid, SIGKILL);
+      waitpid(pid, NULL, 0);
+    }
+    close(out[0]);
+    close(err[0]);
+    return -1;
+  }
+
+  s->pid = pid;
+  s->pidfd = pidfd;
+  s->out_pipe = out[0];
+  s->err_pipe = err[0];
+  s->reaped = 0;
+  serve_watch(EPOLL_CTL_ADD, s->out_pipe, EPOLLIN, &s->out_src);
+  serve_watch(EPOLL_CTL_ADD, s->err_pipe, EPOLLIN, &s->err_src);
+  serve_watch(EPOLL_CTL_ADD, s->pidfd, EPOLLIN, &s->child_src);
+  child_timer_start(&s->timer, cmd->setup.timeout);
+  if (s->timer.fd >= 0)
+  {
+    serve_watch(EPOLL_CTL_ADD, s->timer.fd, EPOLLIN, &s->timer_src);
+  }
+  return 0;
+}
+
+//runs one line of a session. built-ins finish right away, external
+//commands are started and finish later from the event loop
+static void session_execute(struct session *s, char *line)
+{
+  line[strcspn(line, "\n")] = '\0';
+
+  struct command cmd;
+  if (parse_command(line, &cmd) == 0)
+  {
+    return;
+  }
+  session_remember(s, line);
+
+  int status = STATUS_ERROR;
+  if (strcmp(cmd.token[0], "exit") == 0 || strcmp(cmd.token[0], "quit") == 0)
+  {
+    if (cmd.token_count == 1)
+    {
+      status = 0;
+      s->in_eof = 1;
+      s->in_len = 0; //anything after exit is never run
+    }
+    else
+    {
+      session_error(s);
+    }
+  }
+  else if (strcmp(cmd.token[0], "cd") == 0)
+  {
+    if (cmd.token_count == 2 && session_cd(s, cmd.token[1]) == 0)
+    {
+      status = 0;
+    }
+    else
+    {
+      session_error(s);
+    }
+  }
+  else if (strcmp(cmd.token[0], "history") == 0 && cmd.token_count == 1)
+  {
+    int first = s->history_count > SESSION_HISTORY ? s->history_count - SESSION_HISTORY : 0;
+    for (int i = first; i < s->history_count; i++)
+    {
+      char entry[MAX_COMMAND_SIZE + 16];
+      int len = snprintf(entry, sizeof(entry), "%5d  %s\n", i + 1, s->history[i % SESSION_HISTORY]);
+      session_frame(s, 'o', entry, len, 0);
+    }
+    status = 0;
+  }
+  else if (cmd.annotation_error || cmd.after_count > 0 || cmd.retry > 0 || cmd.syntax_error || cmd.argv[0] == NULL ||
+           !session_resolve(s, cmd.token[0], cmd.cmd_path, sizeof(cmd.cmd_path)))
+  {
+    session_error(s);
+  }
+  else if (session_spawn(s, &cmd) != 0)
+  {
+    session_error(s);
+  }
+  else
+  {
+    free_command(&cmd);
+    return; //the status frame follows when the command is done
+  }
+  session_frame(s, 'x', NULL, 0, status);
+  free_command(&cmd);
+}
+
+//runs queued lines until one of them starts a command
+static void session_run_input(struct session *s)
+{
+  while (s->pid == 0 && s->in_len > 0)
+  {
+    char *newline = memchr(s->in, '\n', s->in_len);
+    size_t len;
+    if (newline != NULL)
+    {
+      len = newline - s->in + 1;
+    }
+    else if (s->in_len >= MAX_COMMAND_SIZE - 1 || s->in_eof) //split like fgets() would
+    {
+      len = s->in_len < MAX_COMMAND_SIZE - 1 ? s->in_len : MAX_COMMAND_SIZE - 1;
+    }
+    else
+    {
+      break; //wait for the rest of the line
+    }
+    if (len > MAX_COMMAND_SIZE - 1)
+    {
+      len = MAX_COMMAND_SIZE - 1;
+    }
+
+    char line[MAX_COMMAND_SIZE];
+    memcpy(line, s->in, len);
+    line[len] = '\0';
+    memmove(s->in, s->in + len, s->in_len - len);
+    s->in_len -= len;
+    session_execute(s, line);
+  }
+}
+
+//forwards whatever a command wrote to one of its pipes
+static void session_read_pipe(struct session *s, int *fd, struct source *src, char kind)
+{
+  char buf[16384];
+  ssize_t n = read(*fd, buf, sizeof(buf));
+  if (n > 0)
+  {
+    session_frame(s, kind, buf, n, 0);
+  }
+  else if (n == 0 || errno != EINTR)
+  {
+    serve_watch(EPOLL_CTL_DEL, *fd, 0, src);
+    close(*fd);
+    *fd = -1;
+  }
+}
+
+//once the command has exited and both pipes are drained its status is sent
+static void session_check_done(struct session *s)
+{
+  if (s->pid == 0 || !s->reaped || s->out_pipe >= 0 || s->err_pipe >= 0)
+  {
+    return;
+  }
+  s->pid = 0;
+  session_frame(s, 'x', NULL, 0, s->status);
+}
+
+//handles one epoll event, returns 1 if the session has ended and was freed
+static int session_event(struct session *s, struct source *src, uint32_t events)
+{
+  switch (src->kind)
+  {
+    case SOURCE_CONN:
+      if (s->in_len == sizeof(s->in) && (events & (EPOLLHUP | EPOLLERR)))
+      {
+        s->in_eof = 1; //no room to read, but nothing more will come anyway
+      }
+      else if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+      {
+        ssize_t n = read(s->fd, s->in + s->in_len, sizeof(s->in) - s->in_len);
+        if (n > 0)
+        {
+          s->in_len += n;
+        }
+        else if (n == 0 || (errno != EINTR && errno != EAGAIN))
+        {
+          s->in_eof = 1;
+        }
+      }
+      break;
+    case SOURCE_STDOUT:
+      session_read_pipe(s, &s->out_pipe, src, 'o');
+      break;
+    case SOURCE_STDERR:
+      session_read_pipe(s, &s->err_pipe, src, 'e');
+      break;
+    case SOURCE_CHILD:
+    {
+      int status;
+      if (waitpid(s->pid, &status, WNOHANG) == s->pid)
+      {
+        serve_watch(EPOLL_CTL_DEL, s->pidfd, 0, src);
+        close(s->pidfd);
+        s->status = s->timer.stage > 0 ? STATUS_TIMEOUT : exit_code(status);
+        s->reaped = 1;
+        child_timer_stop(&s->timer); //closing it also takes it out of the epoll set
+      }
+      break;
+    }
+    case SOURCE_TIMER:
+      child_timer_expired(&s->timer, s->pid);
+      break;
+    default:
+      break;
+  }
+
+  session_check_done(s);
+  session_run_input(s);
+  session_flush(s);
+
+  //the session is over once the client is done sending, every command has
+  //finished and everything has been sent
+  if (s->in_eof && s->pid == 0 && (s->out_len == 0 || s->fd < 0) &&
+      (s->in_len == 0 || s->fd < 0))
+  {
+    if (s->fd >= 0)
+    {
+      serve_watch(EPOLL_CTL_DEL, s->fd, 0, &s->conn_src);
+    }
+    session_destroy(s);
+    return 1;
+  }
+  session_update(s);
+  return 0;
+}
+
+static void session_accept(int listen_fd)
+{
+  int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (fd < 0)
+  {
+    return;
+  }
+  struct session *s = calloc(1, sizeof(*s));
+  s->fd = fd;
+  s->out_pipe = -1;
+  s->err_pipe = -1;
+  s->pidfd = -1;
+  s->timer.fd = -1;
+  s->conn_src = (struct source){SOURCE_CONN, s};
+  s->out_src = (struct source){SOURCE_STDOUT, s};
+  s->err_src = (struct source){SOURCE_STDERR, s};
+  s->child_src = (struct source){SOURCE_CHILD, s};
+  s->timer_src = (struct source){SOURCE_TIMER, s};
+  s->cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (s->cwd_fd < 0)
+  {
+    s->cwd_fd = open("/", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  }
+  serve_watch(EPOLL_CTL_ADD, fd, EPOLLIN, &s->conn_src);
+}
+
+//creates the listening socket, replacing a stale socket file
+static int serve_listen(const char *path)
+{
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path))
+  {
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  struct stat st;
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+  {
+    unlink(path);
+  }
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0)
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+//runs the server until SIGINT or SIGTERM, returns -1 if it could not start
+static int run_server(const char *path)
+{
+  int listen_fd = serve_listen(path);
+  if (listen_fd < 0)
+  {
+    return -1;
+  }
+
+  sigset_t stop;
+  sigemptyset(&stop);
+  sigaddset(&stop, SIGINT);
+  sigaddset(&stop, SIGTERM);
+  sigprocmask(SIG_BLOCK, &stop, NULL);
+  int signal_fd = signalfd(-1, &stop, SFD_CLOEXEC);
+
+  serve_epoll = epoll_create1(EPOLL_CLOEXEC);
+  struct source listen_src = {SOURCE_LISTEN, NULL};
+  struct source signal_src = {SOURCE_SIGNAL, NULL};
+  serve_watch(EPOLL_CTL_ADD, listen_fd, EPOLLIN, &listen_src);
+  serve_watch(EPOLL_CTL_ADD, signal_fd, EPOLLIN, &signal_src);
+
+  int running = 1;
+  while (running)
+  {
+    struct epoll_event events[SERVE_MAX_EVENTS];
+    int n = epoll_wait(serve_epoll, events, SERVE_MAX_EVENTS, -1);
+    for (int i = 0; i < n; i++)
+    {
+      struct source *src = events[i].data.ptr;
+      if (src->kind == SOURCE_LISTEN)
+      {
+        session_accept(listen_fd);
+      }
+      else if (src->kind == SOURCE_SIGNAL)
+      {
+        running = 0;
+      }
+      else if (session_event(src->session, src, events[i].events))
+      {
+        //the session is gone, drop later events that still point into it
+        for (int j = i + 1; j < n; j++)
+        {
+          struct source *later = events[j].data.ptr;
+          if (later->kind != SOURCE_LISTEN && later->kind != SOURCE_SIGNAL &&
+              later->session == src->session)
+          {
+            events[j].data.ptr = &listen_src;
+            events[j].events = 0;
+          }
+        }
+      }
+    }
+  }
+
+  unlink(path);
+  close(listen_fd);
+  close(signal_fd);
+  close(serve_epoll);
+  return 0;
+}
+
+//--coordinate BATCH SOCKET...: spreads the lines of a batch file over msh
+//workers (msh --worker SOCKET, the same daemon as --serve) and prints their
+//output in line order, as if the file had run locally. each worker starts
+//with a contiguous shard of the lines and runs one line at a time; a worker
+//whose shard is used up steals the back half of the largest remaining
+//shard, so slow lines on one worker do not leave the others idle. lines of
+//a worker that disconnects are handed to the others.
+//a cd line is a barrier: the lines before it finish, then it is sent to
+//every worker. exit stops the run. the exit status is 0 if every line
+//succeeded, otherwise the exit code of the first line that failed
+#define COORD_MAX_WORKERS 64
+
+enum coord_kind
+{
+  COORD_BLANK,
+  COORD_RUN, //anything a worker runs on its own, including lines that only fail
+  COORD_CD,
+  COORD_EXIT
+};
+
+struct coord_line
+{
+  char *text; //line including its '\n'
+  enum coord_kind kind;
+  char *frames; //"o"/"e" frames received for it, replayed in order
+  size_t frames_len;
+  int status;
+  int done;
+};
+
+struct coord_worker
+{
+  int fd; //-1 once the worker is gone
+  int *shard; //line numbers left for this worker, taken from the front
+  int shard_head;
+  int shard_tail;
+  int current; //line in flight or -1
+  int keep_output; //whether frames for current are recorded (a cd goes to all workers)
+  char *in; //received bytes not parsed yet
+  size_t in_len;
+  size_t in_cap;
+};
+
+static struct coord_line *coord_lines;
+static int coord_line_count;
+static int coord_next_emit; //first line whose output has not been printed
+static int coord_status;
+
+static int coord_connect(const char *path)
+{
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path))
+  {
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd >= 0 && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+  {
+    close(fd);
+    fd = -1;
+  }
+  return fd;
+}
+
+//prints the output of every finished line that is next in order
+static void coord_emit(void)
+{
+  while (coord_next_emit < coord_line_count && coord_lines[coord_next_emit].done)
+  {
+    struct coord_line *line = &coord_lines[coord_next_emit];
+    size_t pos = 0;
+    while (pos < line->frames_len)
+    {
+      char *newline = memchr(line->frames + pos, '\n', line->frames_len - pos);
+      size_t len = strtoul(line->frames + pos + 2, NULL, 10);
+      write_all(line->frames[pos] == 'o' ? STDOUT_FILENO : STDERR_FILENO, newline + 1, len);
+      pos = newline + 1 - line->frames + len;
+    }
+    if (line->status != 0 && coord_status == 0)
+    {
+      coord_status = line->status > 0 && line->status < 256 ? line->status : 1;
+    }
+    free(line->frames);
+    line->frames = NULL;
+    coord_next_emit++;
+  }
+}
+
+static void coord_drop_worker(struct coord_worker *w)
+{
+  close(w->fd);
+  w->fd = -1;
+}
+
+//sends the next line to an idle worker, stealing one if its shard is empty
+//returns 1 if the worker got a line
+static int coord_dispatch(struct coord_worker *w, struct coord_worker *workers, int count)
+{
+  if (w->shard_head == w->shard_tail)
+  {
+    struct coord_worker *victim = NULL;
+    for (int i = 0; i < count; i++)
+    {
+      int left = workers[i].shard_tail - workers[i].shard_head;
+      if (left > 0 && (victim == NULL || left > victim->shard_tail - victim->shard_head))
+      {
+        victim = &workers[i];
+      }
+    }
+    if (victim == NULL)
+    {
+      return 0;
+    }
+    int take = (victim->shard_tail - victim->shard_head + 1) / 2;
+    w->shard_head = 0;
+    w->shard_tail = take;
+    memcpy(w->shard, victim->shard + victim->shard_tail - take, take * sizeof(int));
+    victim->shard_tail -= take;
+  }
+
+  w->current = w->shard[w->shard_head++];
+  w->keep_output = 1;
+  struct coord_line *line = &coord_lines[w->current];
+  if (send(w->fd, line->text, strlen(line->text), MSG_NOSIGNAL) < 0)
+  {
+    w->shard[--w->shard_head] = w->current; //leave it for another worker
+    w->current = -1;
+    coord_drop_worker(w);
+    return 0;
+  }
+  return 1;
+}
+
+//parses the frames a worker sent, returns 1 when its current line finished
+static int coord_receive(struct coord_worker *w)
+{
+  if (w->in_cap - w->in_len < 16384)
+  {
+    w->in_cap = w->in_cap * 2 + 16384;
+    w->in = realloc(w->in, w->in_cap);
+  }
+  ssize_t n = recv(w->fd, w->in + w->in_len, w->in_cap - w->in_len, 0);
+  if (n <= 0)
+  {
+    if (n < 0 && errno == EINTR)
+    {
+      return 0;
+    }
+    coord_drop_worker(w);
+    return 0;
+  }
+  w->in_len += n;
+
+  int finished = 0;
+  size_t pos = 0;
+  while (!finished)
+  {
+    char *newline = memchr(w->in + pos, '\n', w->in_len - pos);
+    if (newline == NULL)
+    {
+      break;
+    }
+    size_t header_len = newline + 1 - (w->in + pos);
+    struct coord_line *line = &coord_lines[w->current];
+    if (w->in[pos] == 'x')
+    {
+      if (w->keep_output)
+      {
+        line->status = atoi(w->in + pos + 2);
+      }
+      pos += header_len;
+      finished = 1;
+      continue;
+    }
+    size_t len = strtoul(w->in + pos + 2, NULL, 10);
+    if (w->in_len - pos < header_len + len)
+    {
+      break; //frame data not complete yet
+    }
+    if (w->keep_output)
+    {
+      line->frames = realloc(line->frames, line->frames_len + header_len + len);
+      memcpy(line->frames + line->frames_len, w->in + pos, header_len + len);
+      line->frames_len += header_len + len;
+    }
+    pos += header_len + len;
+  }
+  memmove(w->in, w->in + pos, w->in_len - pos);
+  w->in_len -= pos;
+  return finished;
+}
+
+//waits for the in-flight lines of all workers and dispatches more
+//while any shard still holds lines. returns -1 if every worker is gone
+static int coord_run(struct coord_worker *workers, int count, int dispatch)
+{
+  while (1)
+  {
+    struct pollfd fds[COORD_MAX_WORKERS];
+    int busy = 0;
+    int alive = 0;
+    //lines in flight on lost workers go back first, so every idle worker
+    //below can pick them up
+    for (int i = 0; i < count; i++)
+    {
+      struct coord_worker *w = &workers[i];
+      if (w->fd < 0 && w->current >= 0)
+      {
+        if (dispatch) //a cd is sent to every worker, there is nothing to run again
+        {
+          struct coord_line *line = &coord_lines[w->current];
+          free(line->frames); //the next run prints it all again
+          line->frames = NULL;
+          line->frames_len = 0;
+          w->shard[w->shard_tail++] = w->current;
+        }
+        w->current = -1;
+      }
+    }
+    for (int i = 0; i < count; i++)
+    {
+      struct coord_worker *w = &workers[i];
+      if (w->fd >= 0 && w->current < 0 && dispatch)
+      {
+        coord_dispatch(w, workers, count);
+      }
+      alive += w->fd >= 0;
+      busy += w->fd >= 0 && w->current >= 0;
+      fds[i].fd = w->current >= 0 ? w->fd : -1;
+      fds[i].events = POLLIN;
+    }
+    if (alive == 0)
+    {
+      return -1;
+    }
+    if (busy == 0)
+    {
+      return 0;
+    }
+
+    if (poll(fds, count, -1) < 0 && errno != EINTR)
+    {
+      return -1;
+    }
+    for (int i = 0; i < count; i++)
+    {
+      struct coord_worker *w = &workers[i];
+      if (fds[i].fd >= 0 && (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) && coord_receive(w))
+      {
+        coord_lines[w->current].done = 1;
+        w->current = -1;
+        coord_emit();
+      }
+    }
+  }
+}
+
+static enum coord_kind coord_line_kind(const char *text)
+{
+  struct command cmd;
+  int token_count = parse_command(text, &cmd);
+  enum coord_kind kind = token_count == 0 ? COORD_BLANK : COORD_RUN;
+  if (token_count == 1 && (strcmp(cmd.token[0], "exit") == 0 || strcmp(cmd.token[0], "quit") == 0))
+  {
+    kind = COORD_EXIT;
+  }
+  else if (token_count == 2 && strcmp(cmd.token[0], "cd") == 0)
+  {
+    kind = COORD_CD;
+  }
+  free_command(&cmd);
+  return kind;
+}
+
+static int run_coordinator(const char *batch_path, char **sockets, int count)
+{
+  FILE *batch_file = fopen(batch_path, "re");
+  if (batch_file == NULL || count > COORD_MAX_WORKERS)
+  {
+    return -1;
+  }
+  char command_string[MAX_COMMAND_SIZE];
+  int capacity = 0;
+  while (fgets(command_string, MAX_COMMAND_SIZE, batch_file))
+  {
+    if (coord_line_count == capacity)
+    {
+      capacity = capacity ? capacity * 2 : 256;
+      coord_lines = realloc(coord_lines, capacity * sizeof(*coord_lines));
+    }
+    struct coord_line *line = &coord_lines[coord_line_count++];
+    memset(line, 0, sizeof(*line));
+    size_t len = strcspn(command_string, "\n");
+    line->text = malloc(len + 2);
+    memcpy(line->text, command_string, len);
+    strcpy(line->text + len, "\n"); //workers need every line terminated
+    line->kind = coord_line_kind(line->text);
+    line->done = line->kind == COORD_BLANK; //nothing to run or print
+  }
+  fclose(batch_file);
+
+  struct coord_worker workers[COORD_MAX_WORKERS];
+  for (int i = 0; i < count; i++)
+  {
+    memset(&workers[i], 0, sizeof(workers[i]));
+    workers[i].fd = coord_connect(sockets[i]);
+    workers[i].current = -1;
+    workers[i].shard = malloc((coord_line_count + 1) * sizeof(int));
+    if (workers[i].fd < 0)
+    {
+      return -1;
+    }
+  }
+
+  int pos = 0;
+  while (pos < coord_line_count)
+  {
+    enum coord_kind kind = coord_lines[pos].kind;
+    if (kind == COORD_BLANK)
+    {
+      pos++;
+      coord_emit();
+      continue;
+    }
+    if (kind == COORD_EXIT)
+    {
+      break;
+    }
+    if (kind == COORD_CD) //every worker changes directory, the first one reports
+    {
+      int reporter = 1;
+      for (int i = 0; i < count; i++)
+      {
+        struct coord_worker *w = &workers[i];
+        if (w->fd >= 0 && send(w->fd, coord_lines[pos].text, strlen(coord_lines[pos].text), MSG_NOSIGNAL) >= 0)
+        {
+          w->current = pos;
+          w->keep_output = reporter;
+          reporter = 0;
+        }
+      }
+      if (coord_run(workers, count, 0) != 0)
+      {
+        return -1;
+      }
+      coord_lines[pos++].done = 1;
+      coord_emit();
+      continue;
+    }
+
+    //shard everything up to the next cd or exit over the workers
+    int end = pos + 1;
+    while (end < coord_line_count && coord_lines[end].kind != COORD_CD &&
+           coord_lines[end].kind != COORD_EXIT)
+    {
+      end++;
+    }
+    int alive = 0;
+    for (int i = 0; i < count; i++)
+    {
+      alive += workers[i].fd >= 0;
+    }
+    int next = pos;
+    for (int i = 0, k = 0; i < count; i++)
+    {
+      struct coord_worker *w = &workers[i];
+      w->shard_head = w->shard_tail = 0;
+      if (w->fd < 0)
+      {
+        continue;
+      }
+      int share_end = pos + (int)((long)(end - pos) * ++k / alive);
+      for (; next < share_end; next++)
+      {
+        if (coord_lines[next].kind == COORD_RUN)
+        {
+          w->shard[w->shard_tail++] = next;
+        }
+      }
+    }
+    if (coord_run(workers, count, 1) != 0)
+    {
+      return -1;
+    }
+    pos = end;
+  }
+
+  for (int i = 0; i < count; i++)
+  {
+    if (workers[i].fd >= 0)
+    {
+      close(workers[i].fd);
+    }
+    free(workers[i].shard);
+    free(workers[i].in);
+  }
+  return 0;
+}
+
+//-j N: runs a batch file with up to N commands at a time. the whole file
+//is loaded first and turned into a dependency graph: @after edges, plus
+//implicit edges that make every valid exit line a barrier (it waits for all
+//earlier lines and all later lines wait for it), and edges from each cd line
+//to the lines after it up to the next cd. a cd line does not change msh's
+//cwd, it opens its directory as an O_PATH descriptor relative to the one of
+//the cd before it, and msh enters the directory of a line with fchdir() when
+//it starts it, so lines before and after a cd run side by side. a cd whose
+//directory does not exist yet waits for the earlier lines to finish and tries
+//again, one of them may create it. lines become ready once all their predecessors finished and
+//are started in the order they became ready, see resource tags. a line whose @after dependency failed or was
+//skipped is skipped itself. children are watched through pidfds in an epoll
+//loop. jobs only keep their line text and are parsed again when they start,
+//so very large files stay cheap to hold
+enum job_state
+{
+  JOB_WAITING,
+  JOB_READY,
+  JOB_RUNNING,
+  JOB_DONE
+};
+
+struct job
+{
+  char *line;
+  int line_number;
+  int status;
+  unsigned char state;
+  unsigned char barrier; //valid exit
+  unsigned char is_cd; //valid cd
+  unsigned char dep_failed; //an @after predecessor failed or was skipped
+  unsigned char bad_label; //@after names a label no earlier line has
+  int pending; //predecessors not done yet
+  int *next; //successors, shifted left by one with the low bit set for @after edges
+  int next_count;
+  int next_capacity;
+  pid_t pid;
+  int pidfd;
+  char *output; //'>' file whose duration is recorded, for lines with @in
+  char *flight_key; //--dedup key while the line runs
+  char *memo_key; //--cache entry the line's capture process writes
+  int capture_report; //read end the capture process writes its status to, -1 if none
+  int followers; //index + 1 of the first identical line waiting for this one, 0 if none
+  int next_follower; //index + 1 of the next line waiting for the same line
+  int group; //tag_group of the line's resource tags
+  int cwd; //cd line whose directory the line runs in, -1 for the starting one
+  int dirfd; //of a cd line that ran: O_PATH descriptor of its directory
+  int cwd_users; //of a cd line: lines running in its directory not finished yet
+  struct child_timer timer; //@timeout or --timeout of the running line
+  int retry; //@retry of the line, set when it starts
+  int exit_attempts; //runs that failed and were tried again for @retry
+  int fork_attempts; //forks that failed and were tried again
+  double wake_at; //when a delayed job becomes ready again
+  int prio; //@prio of the line
+  double ready_key; //when the job became ready, less one PRIO_AGING per level of priority
+  long ready_seq; //order in which jobs became ready, breaks ties of ready_key
+  double start;
+  double path; //seconds of the longest chain of predecessors ending with this job
+  long path_lines;
+};
+
+static struct job *jobs;
+static int job_count;
+
+//the status a capture process reported through its pipe, closing it, or
+//fallback if it reported none. exit codes cannot carry STATUS_TIMEOUT or
+//STATUS_ERROR
+static int capture_status(int fd, int fallback)
+{
+  int status;
+  if (fd < 0)
+  {
+    return fallback;
+  }
+  ssize_t n = read(fd, &status, sizeof(status));
+  close(fd);
+  return n == sizeof(status) ? status : fallback;
+}
+
+//--dedup: a line identical to one that is still running is not started,
+//it finishes with the status of the running one. identical means the same
+//executable, arguments, redirection and working directory (the cd line the
+//lines run after), and the same annotations that change how it runs:
+//@in, @pure, @retry and the child setup. @label, @after, @prio and tags
+//only order the lines. output to stdout is printed once for all of them
+static int dedup;
+static struct label_map in_flight; //key of a running line to its index + 1, 0 once it finished
+
+static char *dedup_key(struct command *cmd, int cwd)
+{
+  struct child_setup *setup = &cmd->setup;
+  size_t len = 128 + 2 * sizeof(setup->cpus) + strlen(cmd->cmd_path) + 4 +
+               (cmd->redirect != NULL ? strlen(cmd->redirect) : 0);
+  for (int i = 0; cmd->argv[i] != NULL; i++)
+  {
+    len += strlen(cmd->argv[i]) + 1;
+  }
+  for (int i = 0; i < cmd->input_count; i++)
+  {
+    len += strlen(cmd->input[i]) + 4;
+  }
+  char *key = malloc(len);
+  char *p = key + sprintf(key, "%d\n%d %d %d %d %d %lu %a ", cwd, cmd->pure, cmd->retry, setup->has_nice ? setup->nice : 100,
+                          setup->ioprio, setup->has_cpus, (unsigned long)setup->mem, setup->timeout);
+  for (size_t i = 0; setup->has_cpus && i < sizeof(setup->cpus); i++)
+  {
+    p += sprintf(p, "%02x", ((unsigned char *)&setup->cpus)[i]);
+  }
+  for (int i = 0; i < cmd->input_count; i++)
+  {
+    p = stpcpy(p, "\n<\n");
+    p = stpcpy(p, cmd->input[i]);
+  }
+  *p++ = '\n';
+  p = stpcpy(p, cmd->cmd_path);
+  for (int i = 0; cmd->argv[i] != NULL; i++) //tokens never contain a newline
+  {
+    *p++ = '\n';
+    p = stpcpy(p, cmd->argv[i]);
+  }
+  if (cmd->redirect != NULL)
+  {
+    p = stpcpy(p, "\n>\n");
+    stpcpy(p, cmd->redirect);
+  }
+  return key;
+}
+
+//--rate N/s paces the lines started with -j, --rate NAME=N/s the ones
+//tagged @NAME. each is a token bucket holding at most one start, so starts
+//are spaced evenly and never come in a burst. while every ready line waits
+//for a token the scheduler sleeps in epoll_wait until a timerfd armed for
+//the earliest refill fires
+struct token_bucket
+{
+  double rate; //starts per second, 0 for no limit
+  double tokens;
+  double last; //when tokens was brought up to date
+};
+
+static struct token_bucket global_rate;
+#define SCHED_RATE (UINT32_MAX - 2) //epoll data of the rate timer
+static int rate_timer = -1;
+
+//rate like 10/s, 30/m or 100/h (a bare number is per second), returns -1
+//if it is malformed
+static int parse_rate(const char *text, double *rate)
+{
+  char *unit;
+  errno = 0;
+  *rate = strtod(text, &unit);
+  double scale = strcmp(unit, "/m") == 0 ? 60 : strcmp(unit, "/h") == 0 ? 3600 : 1;
+  if (errno != 0 || unit == text || !(*rate > 0) ||
+      (*unit != '\0' && scale == 1 && strcmp(unit, "/s") != 0))
+  {
+    return -1;
+  }
+  *rate /= scale;
+  return 0;
+}
+
+static void bucket_refill(struct token_bucket *bucket, double now)
+{
+  if (bucket->rate > 0)
+  {
+    bucket->tokens += (now - bucket->last) * bucket->rate;
+    bucket->tokens = bucket->tokens > 1 ? 1 : bucket->tokens;
+    bucket->last = now;
+  }
+}
+
+//seconds until the bucket has a token, 0 if it has one now
+static double bucket_wait(struct token_bucket *bucket, double now)
+{
+  bucket_refill(bucket, now);
+  return bucket->rate > 0 && bucket->tokens < 1 ? (1 - bucket->tokens) / bucket->rate : 0;
+}
+
+static void bucket_take(struct token_bucket *bucket)
+{
+  if (bucket->rate > 0)
+  {
+    bucket->tokens -= 1;
+  }
+}
+
+//resource tags: --limit NAME=N allows at most N running lines tagged @NAME
+//(tags without a limit only count against -j). ready lines are queued per
+//set of tags and the earliest ready line whose tags all have room is started
+//next, so lines waiting for a busy tag do not hold up the others.
+//
+//@prio ages instead of being strict: a ready line is ordered as if it had
+//become ready PRIO_AGING seconds earlier per level of priority, so urgent
+//lines overtake bulk ones but a low priority line waiting long enough is
+//still started. the key is fixed when the line becomes ready, so each group
+//keeps its ready lines in a binary heap on it
+#define PRIO_AGING 1.0
+struct tag_group
+{
+  int *tags; //indices into tag_limit and tag_running
+  int tag_count;
+  int *heap; //ready jobs, the one with the smallest key first
+  int count;
+  int capacity;
+};
+
+static struct label_map tag_index; //tag name to index
+static int *tag_limit; //0 for no limit
+static int *tag_running;
+static struct token_bucket *tag_rate;
+static int tag_count;
+static struct tag_group *groups;
+static int group_count;
+static struct label_map group_index; //sorted tag names joined by ',' to group index
+static int ready_count; //ready jobs in all groups
+static int sched_epoll = -1; //epoll data of a child's pidfd is its job index
+#define JOB_TIMER_EVENT 0x80000000u //epoll data of a job's timeout, or'ed with its index
+
+static int tag_lookup(const char *name)
+{
+  int *index = label_map_find(&tag_index, name);
+  if (index != NULL)
+  {
+    return *index;
+  }
+  tag_limit = realloc(tag_limit, (tag_count + 1) * sizeof(int));
+  tag_running = realloc(tag_running, (tag_count + 1) * sizeof(int));
+  tag_rate = realloc(tag_rate, (tag_count + 1) * sizeof(struct token_bucket));
+  tag_limit[tag_count] = 0;
+  tag_running[tag_count] = 0;
+  memset(&tag_rate[tag_count], 0, sizeof(struct token_bucket));
+  label_map_put(&tag_index, name, tag_count);
+  return tag_count++;
+}
+
+//--limit NAME=N, returns -1 if it is malformed
+static int set_tag_limit(char *spec)
+{
+  char *value = strchr(spec, '=');
+  if (value == NULL)
+  {
+    return -1;
+  }
+  *value++ = '\0';
+  int limit;
+  if (!is_tag_name(spec) || parse_int(value, 1, INT_MAX, &limit) != 0)
+  {
+    return -1;
+  }
+  int tag = tag_lookup(spec); //may move tag_limit
+  tag_limit[tag] = limit;
+  return 0;
+}
+
+//--rate N/s or --rate NAME=N/s, returns -1 if it is malformed
+static int set_rate(char *spec)
+{
+  char *value = strchr(spec, '=');
+  struct token_bucket bucket = {.tokens = 1};
+  if (parse_rate(value != NULL ? value + 1 : spec, &bucket.rate) != 0)
+  {
+    return -1;
+  }
+  if (value == NULL)
+  {
+    global_rate = bucket;
+    return 0;
+  }
+  *value = '\0';
+  if (!is_tag_name(spec))
+  {
+    return -1;
+  }
+  int tag = tag_lookup(spec); //may move tag_rate
+  tag_rate[tag] = bucket;
+  return 0;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+//the group of lines with the same set of tags as cmd
+static int tag_group_of(struct command *cmd)
+{
+  char signature[MAX_COMMAND_SIZE + 1] = "";
+  qsort(cmd->tag, cmd->tag_count, sizeof(char *), compare_names);
+  for (int i = 0; i < cmd->tag_count; i++)
+  {
+    if (i == 0 || strcmp(cmd->tag[i], cmd->tag[i - 1]) != 0) //a repeated tag counts once
+    {
+      strcat(strcat(signature, ","), cmd->tag[i]);
+    }
+  }
+  int *index = label_map_find(&group_index, signature);
+  if (index != NULL)
+  {
+    return *index;
+  }
+
+  groups = realloc(groups, (group_count + 1) * sizeof(struct tag_group));
+  struct tag_group *group = &groups[group_count];
+  memset(group, 0, sizeof(*group));
+  group->tags = malloc((cmd->tag_count + 1) * sizeof(int));
+  for (int i = 0; i < cmd->tag_count; i++)
+  {
+    if (i == 0 || strcmp(cmd->tag[i], cmd->tag[i - 1]) != 0)
+    {
+      group->tags[group->tag_count++] = tag_lookup(cmd->tag[i]);
+    }
+  }
+  label_map_put(&group_index, signature, group_count);
+  return group_count++;
+}
+
+static int tag_group_fits(struct tag_group *group)
+{
+  for (int i = 0; i < group->tag_count; i++)
+  {
+    int tag = group->tags[i];
+    if (tag_limit[tag] > 0 && tag_running[tag] >= tag_limit[tag])
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void tag_group_hold(int group, int delta)
+{
+  for (int i = 0; i < groups[group].tag_count; i++)
+  {
+    tag_running[groups[group].tags[i]] += delta;
+  }
+}
+
+static int ready_before(int a, int b)
+{
+  if (jobs[a].ready_key != jobs[b].ready_key)
+  {
+    return jobs[a].ready_key < jobs[b].ready_key;
+  }
+  return jobs[a].ready_seq < jobs[b].ready_seq;
+}
+
+static void group_push(struct tag_group *group, int index)
+{
+  if (group->count == group->capacity)
+  {
+    group->capacity = group->capacity ? group->capacity * 2 : 64;
+    group->heap = realloc(group->heap, group->capacity * sizeof(int));
+  }
+  int i = group->count++;
+  while (i > 0 && ready_before(index, group->heap[(i - 1) / 2]))
+  {
+    group->heap[i] = group->heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  group->heap[i] = index;
+}
+
+static int group_pop(struct tag_group *group)
+{
+  int top = group->heap[0];
+  int last = group->heap[--group->count];
+  int i = 0;
+  while (2 * i + 1 < group->count)
+  {
+    int child = 2 * i + 1;
+    if (child + 1 < group->count && ready_before(group->heap[child + 1], group->heap[child]))
+    {
+      child++;
+    }
+    if (!ready_before(group->heap[child], last))
+    {
+      break;
+    }
+    group->heap[i] = group->heap[child];
+    i = child;
+  }
+  group->heap[i] = last;
+  return top;
+}
+
+//seconds until every --rate of the group's tags has a token
+static double tag_group_wait(struct tag_group *group, double now)
+{
+  double wait = 0;
+  for (int i = 0; i < group->tag_count; i++)
+  {
+    double tag_wait = bucket_wait(&tag_rate[group->tags[i]], now);
+    wait = tag_wait > wait ? tag_wait : wait;
+  }
+  return wait;
+}
+
+static void tag_group_take(int group)
+{
+  bucket_take(&global_rate);
+  for (int i = 0; i < groups[group].tag_count; i++)
+  {
+    bucket_take(&tag_rate[groups[group].tags[i]]);
+  }
+}
+
+//arms the rate timer for when the first ready line that only waits for a
+//token can start, returns 0 and disarms it if there is no such line
+static int rate_rearm(void)
+{
+  double now = now_seconds();
+  double global_wait = bucket_wait(&global_rate, now);
+  double wait = -1;
+  for (int g = 0; g < group_count; g++)
+  {
+    if (groups[g].count > 0 && tag_group_fits(&groups[g]))
+    {
+      double group_wait = tag_group_wait(&groups[g], now);
+      group_wait = group_wait > global_wait ? group_wait : global_wait; //needs both tokens
+      wait = wait < 0 || group_wait < wait ? group_wait : wait;
+    }
+  }
+  if (wait < 0) //the ready lines wait for a --limit, a line finishing wakes them
+  {
+    if (rate_timer >= 0)
+    {
+      struct itimerspec off = {{0, 0}, {0, 0}};
+      timerfd_settime(rate_timer, 0, &off, NULL);
+    }
+    return 0;
+  }
+  if (rate_timer < 0)
+  {
+    rate_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct epoll_event ev = {.events = EPOLLIN, .data.u32 = SCHED_RATE};
+    epoll_ctl(sched_epoll, EPOLL_CTL_ADD, rate_timer, &ev);
+  }
+  wait = wait < 1e-6 ? 1e-6 : wait; //the token may have come since, a zero it_value would disarm it
+  struct itimerspec when = {{0, 0}, {(time_t)wait, (long)((wait - (time_t)wait) * 1e9)}};
+  timerfd_settime(rate_timer, 0, &when, NULL);
+  return 1;
+}
+
+//takes the ready job with the smallest key among the groups with room and
+//tokens, returns -1 if there is none
+static int next_ready_job(void)
 {
+  int best = -1;
+  double now = now_seconds();
+  if (bucket_wait(&global_rate, now) > 0)
+  {
+    return -1;
+  }
+  for (int g = 0; g < group_count; g++)
+  {
+    struct tag_group *group = &groups[g];
+    if (group->count > 0 && tag_group_fits(group) && tag_group_wait(group, now) == 0 &&
+        (best < 0 || ready_before(group->heap[0], groups[best].heap[0])))
+    {
+      best = g;
+    }
+  }
+  if (best < 0)
+  {
+    return -1;
+  }
+  ready_count--;
+  return group_pop(&groups[best]);
+}
 
-  char* command_string = (char*)malloc(MAX_COMMAND_SIZE); //holds user's input command
-  char error_message[30] = "An error has occurred\n";
+static void free_tag_groups(void)
+{
+  for (int g = 0; g < group_count; g++)
+  {
+    free(groups[g].tags);
+    free(groups[g].heap);
+  }
+  free(groups);
+  groups = NULL;
+  group_count = 0;
+  free_label_map(&group_index);
+}
 
-  FILE* batch_file = NULL; //batch mode file pointer
-  int is_batch_mode = 0;
+static void job_add_edge(int from, int to, int after)
+{
+  struct job *job = &jobs[from];
+  if (job->next_count == job->next_capacity)
+  {
+    job->next_capacity = job->next_capacity ? job->next_capacity * 2 : 4;
+    job->next = realloc(job->next, job->next_capacity * sizeof(int));
+  }
+  job->next[job->next_count++] = to << 1 | after;
+  jobs[to].pending++;
+}
 
-  if (argc > 2)
+static void job_make_ready(int index)
+{
+  static long ready_sequence;
+  jobs[index].state = JOB_READY;
+  jobs[index].ready_key = now_seconds() - jobs[index].prio * PRIO_AGING;
+  jobs[index].ready_seq = ready_sequence++;
+  group_push(&groups[jobs[index].group], index);
+  ready_count++;
+}
+
+//jobs waiting for a retry are kept aside until their backoff has passed.
+//one timerfd in the epoll set is armed for the earliest of them
+#define SCHED_DELAY (UINT32_MAX - 1) //epoll data of the retry timer
+static int *delayed; //indices of jobs waiting for a retry
+static int delayed_count;
+static int delayed_capacity;
+static int delay_timer = -1;
+
+static void delay_rearm(void)
+{
+  double earliest = 0;
+  for (int i = 0; i < delayed_count; i++)
+  {
+    if (i == 0 || jobs[delayed[i]].wake_at < earliest)
+    {
+      earliest = jobs[delayed[i]].wake_at;
+    }
+  }
+  if (delayed_count > 0)
+  {
+    double wait = earliest - now_seconds();
+    arm_timer(delay_timer, wait > 0 ? wait : 0);
+  }
+}
+
+//puts a job aside to become ready again after seconds
+static void job_delay(int index, double seconds)
+{
+  if (delay_timer < 0)
+  {
+    delay_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct epoll_event ev = {.events = EPOLLIN, .data.u32 = SCHED_DELAY};
+    epoll_ctl(sched_epoll, EPOLL_CTL_ADD, delay_timer, &ev);
+  }
+  if (delayed_count == delayed_capacity)
+  {
+    delayed_capacity = delayed_capacity ? delayed_capacity * 2 : 16;
+    delayed = realloc(delayed, delayed_capacity * sizeof(int));
+  }
+  jobs[index].state = JOB_WAITING;
+  jobs[index].wake_at = now_seconds() + seconds;
+  delayed[delayed_count++] = index;
+  delay_rearm();
+}
+
+//makes the jobs whose backoff has passed ready
+static void delay_expired(void)
+{
+  uint64_t expirations;
+  double now = now_seconds();
+  int kept = 0;
+  read(delay_timer, &expirations, sizeof(expirations));
+  for (int i = 0; i < delayed_count; i++)
+  {
+    if (jobs[delayed[i]].wake_at <= now)
+    {
+      job_make_ready(delayed[i]);
+    }
+    else
+    {
+      delayed[kept++] = delayed[i];
+    }
+  }
+  delayed_count = kept;
+  delay_rearm();
+}
+
+//forgets what a run of a job left behind before it runs again
+static void job_reset_run(struct job *job)
+{
+  if (job->flight_key != NULL) //identical lines arriving now start on their own
+  {
+    label_map_put(&in_flight, job->flight_key, 0);
+    free(job->flight_key);
+    job->flight_key = NULL;
+  }
+  free(job->output);
+  job->output = NULL;
+  free(job->memo_key);
+  job->memo_key = NULL;
+}
+
+//reads the batch file into jobs[] and wires up the dependency graph
+//lines that depend on an unknown label are made to fail when they run
+static void load_jobs(FILE *batch_file)
+{
+  char command_string[MAX_COMMAND_SIZE];
+  struct label_map labels = {0};
+  int capacity = 0;
+  int last_barrier = -1;
+  int last_cd = -1;
+  int line_number = 0;
+  int starts_line = 1; //the previous chunk ended with its newline
+
+  while (fgets(command_string, MAX_COMMAND_SIZE, batch_file))
+  {
+    if (starts_line)
+    {
+      line_number++; //the rest of an overlong line keeps the line's number
+    }
+    starts_line = command_string[strcspn(command_string, "\n")] == '\n';
+    command_string[strcspn(command_string, "\n")] = '\0'; //replaces newline with null terminator
+
+    struct command cmd;
+    if (parse_command(command_string, &cmd) == 0) //skip empty and blank lines
+    {
+      continue;
+    }
+    if (job_count == capacity)
+    {
+      capacity = capacity ? capacity * 2 : 1024;
+      jobs = realloc(jobs, capacity * sizeof(struct job));
+    }
+    int index = job_count++;
+    struct job *job = &jobs[index];
+    memset(job, 0, sizeof(*job));
+    job->line = strdup(command_string);
+    job->line_number = line_number;
+    job->pidfd = -1;
+    job->timer.fd = -1;
+    job->capture_report = -1;
+    job->group = tag_group_of(&cmd);
+    job->prio = cmd.prio;
+    job->cwd = last_cd;
+    job->dirfd = -1;
+    job->is_cd = !cmd.annotation_error && cmd.token_count == 2 && strcmp(cmd.token[0], "cd") == 0;
+    job->barrier = !cmd.annotation_error && cmd.token_count == 1 &&
+                   (strcmp(cmd.token[0], "exit") == 0 || strcmp(cmd.token[0], "quit") == 0);
+    if (last_cd >= 0)
+    {
+      job_add_edge(last_cd, index, 0);
+      jobs[last_cd].cwd_users++;
+    }
+    if (job->is_cd)
+    {
+      last_cd = index;
+    }
+
+    for (int i = 0; i < cmd.after_count; i++)
+    {
+      int *dep = label_map_find(&labels, cmd.after[i]);
+      if (dep != NULL)
+      {
+        job_add_edge(*dep, index, 1);
+      }
+      else
+      {
+        job->bad_label = 1;
+      }
+    }
+    if (job->barrier)
+    {
+      for (int i = last_barrier + 1; i < index; i++)
+      {
+        job_add_edge(i, index, 0);
+      }
+      last_barrier = index;
+    }
+    else if (last_barrier >= 0)
+    {
+      job_add_edge(last_barrier, index, 0);
+    }
+    if (cmd.label != NULL)
+    {
+      label_map_put(&labels, cmd.label, index);
+    }
+    free_command(&cmd);
+  }
+
+  for (size_t i = 0; i < labels.capacity; i++)
+  {
+    free(labels.keys[i]);
+  }
+  free(labels.keys);
+  free(labels.values);
+}
+
+//working directories of -j lines, see the cd lines above run_jobs
+static int start_cwd_fd = -1; //directory the batch started in
+static int current_cwd = -1; //cd line whose directory msh is in, -1 for the starting one
+static int first_unfinished; //lines before it are done
+static int deferred_cd = -1; //cd line waiting for the lines before it, cd lines run one at a time
+
+static int cwd_fd(int cwd)
+{
+  return cwd >= 0 ? jobs[cwd].dirfd : start_cwd_fd;
+}
+
+//makes msh's cwd the directory the job runs in, so lookups, redirects and
+//@in files of the line are relative to it and its child starts there
+//returns -1 if the directory cannot be entered
+static int enter_job_cwd(struct job *job)
+{
+  int result = 0;
+  if (job->cwd == current_cwd)
+  {
+    return 0;
+  }
+  pthread_mutex_lock(&lookup_lock);
+  if (fchdir(cwd_fd(job->cwd)) == 0)
+  {
+    flush_lookup_cache(); //"./" lookups now refer to a different directory
+    watch_cwd();
+    current_cwd = job->cwd;
+  }
+  else
+  {
+    result = -1;
+  }
+  pthread_mutex_unlock(&lookup_lock);
+  return result;
+}
+
+//a line running in the directory of cd line cwd finished
+static void release_cwd(int cwd)
+{
+  if (cwd >= 0 && --jobs[cwd].cwd_users == 0 && jobs[cwd].state == JOB_DONE)
+  {
+    close(jobs[cwd].dirfd);
+    jobs[cwd].dirfd = -1;
+  }
+}
+
+//runs the cd line index, returns its status, or 1 if it waits for the
+//lines before it. a failed cd leaves the lines after it in the directory
+//of the cd before it, as it would without -j
+static int job_cd(int index, const char *dir)
+{
+  struct job *job = &jobs[index];
+  int base = cwd_fd(job->cwd);
+  int fd = open_directory_at(base, dir);
+  if (fd < 0 && first_unfinished < index)
+  {
+    job->state = JOB_WAITING;
+    deferred_cd = index;
+    return 1;
+  }
+  if (fd < 0)
+  {
+    print_error();
+    job->dirfd = fcntl(base, F_DUPFD_CLOEXEC, 0);
+    return STATUS_ERROR;
+  }
+  job->dirfd = fd;
+  return 0;
+}
+
+//--fanout K: forking every line from one process serializes the launches
+//on that process, and each fork has to copy its page tables. with fan-out
+//the loaded lines are dealt round robin to K helpers forked from msh, each
+//running the scheduler on its share with its part of the -j slots. helpers
+//report every finished line's status over a pipe so msh can count it and
+//journal it, and leave their other --stats counters in shared memory.
+//only batches of independent lines fan out: @after, labels, cd and exit
+//order lines across helpers, and --limit, --rate, --dedup and -j auto are
+//global to the batch, so those run in one scheduler as before
+struct fanout_record
+{
+  int line_number;
+  int status;
+};
+
+struct fanout_share
+{
+  struct run_stats stats;
+  long fork_retries;
+  long fork_failures;
+};
+
+static int fanout; //--fanout K, 0 for one scheduler
+static int fanout_pipe = -1; //write end in a helper
+
+//called by finish_job in a helper
+static void fanout_report(int line_number, int status)
+{
+  struct fanout_record record = {line_number, status};
+  write_all(fanout_pipe, (const char *)&record, sizeof(record));
+}
+
+//marks a job done and releases the jobs waiting for it
+static void finish_job(int index, int status)
+{
+  struct job *job = &jobs[index];
+  job->state = JOB_DONE;
+  job->status = status;
+  if (job->is_cd && job->dirfd < 0) //skipped or failed early, the lines after it stay where it was
+  {
+    job->dirfd = fcntl(cwd_fd(job->cwd), F_DUPFD_CLOEXEC, 0);
+  }
+  if (job->output != NULL)
+  {
+    if (status == 0 && enter_job_cwd(job) == 0) //the output path is relative to it
+    {
+      record_duration(job->output, now_seconds() - job->start);
+    }
+    free(job->output);
+    job->output = NULL;
+  }
+  if (job->flight_key != NULL)
+  {
+    label_map_put(&in_flight, job->flight_key, 0);
+    free(job->flight_key);
+    job->flight_key = NULL;
+  }
+  if (fanout_pipe >= 0)
+  {
+    fanout_report(job->line_number, status);
+  }
+  else
+  {
+    count_status(status);
+    journal_record(job->line_number, status);
+  }
+  if (job->path > stats.critical_path)
+  {
+    stats.critical_path = job->path;
+    stats.critical_lines = job->path_lines;
+  }
+
+  for (int i = 0; i < job->next_count; i++)
+  {
+    struct job *next = &jobs[job->next[i] >> 1];
+    if ((job->next[i] & 1) && status != 0)
+    {
+      next->dep_failed = 1;
+    }
+    if (job->path > next->path) //longest chain so far, the successor adds its own time later
+    {
+      next->path = job->path;
+      next->path_lines = job->path_lines;
+    }
+    if (--next->pending == 0)
+    {
+      job_make_ready(job->next[i] >> 1);
+    }
+  }
+  free(job->next);
+  job->next = NULL;
+  free(job->line);
+  job->line = NULL;
+
+  if (job->is_cd && job->cwd_users == 0 && job->dirfd >= 0) //no line runs in its directory
+  {
+    close(job->dirfd);
+    job->dirfd = -1;
+  }
+  release_cwd(job->cwd);
+  while (first_unfinished < job_count && jobs[first_unfinished].state == JOB_DONE)
+  {
+    first_unfinished++;
+  }
+  if (deferred_cd >= 0 && first_unfinished == deferred_cd)
+  {
+    int cd = deferred_cd;
+    deferred_cd = -1;
+    job_make_ready(cd);
+  }
+
+  for (int f = job->followers; f != 0; f = jobs[f - 1].next_follower)
+  {
+    struct job *follower = &jobs[f - 1];
+    follower->path += now_seconds() - follower->start;
+    follower->path_lines++;
+    finish_job(f - 1, status);
+  }
+}
+
+//starts a ready job. built-ins, lines that fail right away and skipped
+//lines finish immediately, returns 1 if a child was started
+static int start_job(int index)
+{
+  struct job *job = &jobs[index];
+  struct command cmd;
+  int status = STATUS_ERROR;
+
+  job->start = now_seconds();
+  if (job->dep_failed)
+  {
+    finish_job(index, STATUS_SKIPPED);
+    return 0;
+  }
+
+  if (enter_job_cwd(job) != 0)
+  {
+    print_error();
+    finish_job(index, STATUS_ERROR);
+    return 0;
+  }
+  parse_command(job->line, &cmd);
+  cmd.line_number = job->line_number;
+  double saved;
+  if (cmd.annotation_error || job->bad_label)
+  {
+    print_error();
+  }
+  else if (journal_skips(&cmd))
+  {
+    free_command(&cmd);
+    stats.resumed++;
+    finish_job(index, 0);
+    return 0;
+  }
+  else if (output_up_to_date(&cmd, &saved))
+  {
+    free_command(&cmd);
+    stats.up_to_date++;
+    stats.saved += saved;
+    finish_job(index, 0);
+    return 0;
+  }
+  else if (job->is_cd && (status = job_cd(index, cmd.token[1])) == 1)
+  {
+    free_command(&cmd);
+    return 0;
+  }
+  else if (!job->is_cd && !run_builtin(cmd.token, cmd.token_count, &status))
+  {
+    resolve_parsed_command(&cmd);
+    char *flight_key = dedup && cmd.found && !cmd.syntax_error ? dedup_key(&cmd, job->cwd) : NULL;
+    int *leader = flight_key != NULL ? label_map_find(&in_flight, flight_key) : NULL;
+    int coalesce = leader != NULL && *leader != 0;
+    char key[MEMO_NAME_SIZE];
+    int memoize = !coalesce && memo_applies(&cmd) && memo_key(&cmd, key) == 0;
+    if (!cmd.found || cmd.syntax_error)
+    {
+      print_error();
+    }
+    else if (coalesce)
+    {
+      struct job *first = &jobs[*leader - 1];
+      job->next_follower = first->followers;
+      first->followers = index + 1;
+      stats.coalesced++;
+      free(flight_key);
+      free_command(&cmd);
+      return 0;
+    }
+    else if (memoize && memo_replay(key, cmd.redirect, cmd.retry, &status))
+    {
+      //replayed from the cache, nothing to start
+    }
+    else
+    {
+      if (cmd.input_count > 0 && cmd.redirect != NULL)
+      {
+        job->output = strdup(cmd.redirect);
+      }
+      job->retry = cmd.retry;
+      int report[2] = {-1, -1}; //carries the capture's status, which may not fit an exit code
+      if (memoize && pipe2(report, O_CLOEXEC) != 0)
+      {
+        report[0] = report[1] = -1;
+      }
+      pid_t pid = fork();
+      int fork_errno = errno;
+      if (pid == 0 && memoize) //the capture runs in its own process so others keep going
+      {
+        int capture = memo_capture(&cmd, key);
+        if (report[1] >= 0)
+        {
+          write_all(report[1], (const char *)&capture, sizeof(capture));
+        }
+        _exit(capture);
+      }
+      if (report[1] >= 0)
+      {
+        close(report[1]);
+      }
+      if (pid < 0 && report[0] >= 0)
+      {
+        close(report[0]);
+      }
+      if (pid == 0)
+      {
+        exec_child(cmd.cmd_path, cmd.argv, cmd.redirect, &cmd.setup);
+      }
+      double timeout = memoize ? 0 : cmd.setup.timeout; //a capture enforces its own
+      if (pid > 0 && timeout > 0)
+      {
+        setpgid(pid, pid);
+      }
+      job->pidfd = pid > 0 ? pidfd_open(pid, 0) : -1;
+      if (pid > 0 && job->pidfd < 0) //cannot watch it, so wait for it right here
+      {
+        struct child_timer timer;
+        child_timer_start(&timer, timeout);
+        int wstatus = wait_child_timed(pid, &timer);
+        child_timer_stop(&timer);
+        status = capture_status(report[0], timer.stage > 0 ? STATUS_TIMEOUT : exit_code(wstatus));
+        if (memoize)
+        {
+          memo_account(key);
+        }
+      }
+      else if (pid > 0)
+      {
+        if (memoize)
+        {
+          job->memo_key = strdup(key);
+        }
+        job->capture_report = report[0];
+        job->pid = pid;
+        job->state = JOB_RUNNING;
+        struct epoll_event ev = {.events = EPOLLIN, .data.u32 = index};
+        epoll_ctl(sched_epoll, EPOLL_CTL_ADD, job->pidfd, &ev);
+        child_timer_start(&job->timer, timeout);
+        if (job->timer.fd >= 0)
+        {
+          struct epoll_event timer_ev = {.events = EPOLLIN, .data.u32 = index | JOB_TIMER_EVENT};
+          epoll_ctl(sched_epoll, EPOLL_CTL_ADD, job->timer.fd, &timer_ev);
+        }
+        if (flight_key != NULL)
+        {
+          label_map_put(&in_flight, flight_key, index + 1);
+          job->flight_key = flight_key;
+        }
+        free_command(&cmd);
+        return 1;
+      }
+      else if ((fork_errno == EAGAIN || fork_errno == ENOMEM) && job->fork_attempts < SPAWN_RETRY_LIMIT)
+      {
+        job->fork_attempts++;
+        fork_retries++;
+        job_reset_run(job);
+        free(flight_key);
+        free_command(&cmd);
+        job->path += now_seconds() - job->start;
+        job_delay(index, backoff_delay(job->fork_attempts));
+        return 0;
+      }
+      else
+      {
+        fork_failures += fork_errno == EAGAIN || fork_errno == ENOMEM;
+        print_error(); //fork failed
+      }
+    }
+    free(flight_key);
+  }
+  free_command(&cmd);
+  job->path += now_seconds() - job->start;
+  job->path_lines++;
+  finish_job(index, status);
+  return 0;
+}
+
+//-j auto: how many lines run at a time follows the load of the machine.
+//every tick an additive-increase/multiplicative-decrease controller reads
+//the pressure stall information of cpu, memory and io and the cpu time of
+//the lines reaped since the last tick (rusage from wait4()). pressure is
+//the share of the tick some task stalled, from the growth of the "some"
+//total= counter; the avg10 averages would keep reporting a spike for ten
+//seconds after it ended and halve the limit on every tick meanwhile
+//  - pressure on any of them halves the limit
+//  - otherwise a full limit with lines waiting raises it by one, as long
+//    as our lines leave some of the cpus idle
+//without a readable cpu pressure file (kernels without PSI) the limit
+//stays at its start, the number of cpus. each decision is written to the
+//--sched-log file
+#define SCHED_TICK_MS 1000
+#define SCHED_TIMER UINT32_MAX //epoll data of the controller tick
+#define PRESSURE_CPU 50.0 //percentages of the tick taken as pressure
+#define PRESSURE_MEMORY 10.0
+#define PRESSURE_IO 40.0
+#define SCHED_CPU_BUSY 0.9 //share of all cpus our lines may use and still get more slots
+#define SCHED_MAX_PER_CPU 8
+
+static struct
+{
+  int adaptive; //-j auto
+  int limit; //lines run at a time
+  int max_limit;
+  int cpus;
+  double child_cpu; //cpu seconds of lines reaped since the last tick
+  double start;
+  double last_tick;
+  FILE *log; //--sched-log
+  const char *pressure_dir; //--pressure-dir, /proc/pressure by default
+  int has_pressure; //the cpu pressure file could be read at the start
+  unsigned long long stall[3]; //"some" totals of cpu, memory and io at the last tick
+} sched_control;
+
+static const char *const pressure_names[] = {"cpu", "memory", "io"};
+
+//the "some" total= of a pressure file in microseconds, returns -1 if the
+//file is missing or malformed
+static int read_pressure_total(const char *resource, unsigned long long *total)
+{
+  char path[PATH_MAX];
+  int result = -1;
+  snprintf(path, sizeof(path), "%s/%s", sched_control.pressure_dir, resource);
+  FILE *psi = fopen(path, "re");
+  if (psi != NULL)
+  {
+    result = fscanf(psi, "some avg10=%*f avg60=%*f avg300=%*f total=%llu", total) == 1 ? 0 : -1;
+    fclose(psi);
+  }
+  return result;
+}
+
+//percentage of the seconds since the last tick that some task stalled on
+//resource i, 0 if its file cannot be read
+static double read_pressure(int i, double seconds)
+{
+  unsigned long long total;
+  if (read_pressure_total(pressure_names[i], &total) != 0 || total < sched_control.stall[i] || seconds <= 0)
+  {
+    return 0;
+  }
+  double stalled = (total - sched_control.stall[i]) / 1e6;
+  sched_control.stall[i] = total;
+  return 100 * stalled / seconds;
+}
+
+static void sched_tick(int running, int waiting)
+{
+  double now = now_seconds();
+  double seconds = now - sched_control.last_tick;
+  double cpu = read_pressure(0, seconds);
+  double memory = read_pressure(1, seconds);
+  double io = read_pressure(2, seconds);
+  double share = sched_control.child_cpu / (seconds * sched_control.cpus);
+  int old_limit = sched_control.limit;
+  const char *action = "hold";
+
+  if (!sched_control.has_pressure)
+  {
+    action = "fixed";
+  }
+  else if (cpu >= PRESSURE_CPU || memory >= PRESSURE_MEMORY || io >= PRESSURE_IO)
+  {
+    sched_control.limit = old_limit > 1 ? old_limit / 2 : 1;
+    action = "decrease";
+  }
+  else if (running >= old_limit && waiting > 0 && share < SCHED_CPU_BUSY && old_limit < sched_control.max_limit)
+  {
+    sched_control.limit++;
+    action = "increase";
+  }
+  if (sched_control.log != NULL)
+  {
+    fprintf(sched_control.log,
+            "%.3f cpu=%.2f memory=%.2f io=%.2f child_cpu=%.2f running=%d waiting=%d limit=%d->%d %s\n",
+            now - sched_control.start, cpu, memory, io, share, running, waiting, old_limit,
+            sched_control.limit, action);
+    fflush(sched_control.log);
+  }
+  sched_control.child_cpu = 0;
+  sched_control.last_tick = now;
+}
+
+//returns a timerfd ticking the controller, or -1 without -j auto
+static int sched_start(int max_jobs)
+{
+  sched_control.limit = max_jobs;
+  sched_control.start = sched_control.last_tick = now_seconds();
+  if (!sched_control.adaptive)
+  {
+    return -1;
+  }
+  if (sched_control.pressure_dir == NULL)
   {
-    write(STDERR_FILENO, error_message, strlen(error_message));
-    exit(1);
+    sched_control.pressure_dir = "/proc/pressure";
   }
-  else if (argc == 2)
+  sched_control.has_pressure = 0;
+  for (int i = 0; i < 3; i++)
   {
-    batch_file = fopen(argv[1], "r");
-    if (batch_file == NULL)
+    if (read_pressure_total(pressure_names[i], &sched_control.stall[i]) != 0)
     {
-      write(STDERR_FILENO, error_message, strlen(error_message));
-      exit(1);
+      sched_control.stall[i] = 0;
+    }
+    else if (i == 0)
+    {
+      sched_control.has_pressure = 1;
     }
-    is_batch_mode = 1;
   }
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  struct itimerspec tick = {{SCHED_TICK_MS / 1000, (SCHED_TICK_MS % 1000) * 1000000},
+                            {SCHED_TICK_MS / 1000, (SCHED_TICK_MS % 1000) * 1000000}};
+  struct epoll_event ev = {.events = EPOLLIN, .data.u32 = SCHED_TIMER};
+  if (fd >= 0)
+  {
+    timerfd_settime(fd, 0, &tick, NULL);
+    epoll_ctl(sched_epoll, EPOLL_CTL_ADD, fd, &ev);
+  }
+  return fd;
+}
 
-  while(1) //main shell interaction loop
+//runs the loaded jobs first, first + step, ... and what they release
+static void schedule_jobs(int max_jobs, int first, int step)
+{
+  sched_epoll = epoll_create1(EPOLL_CLOEXEC);
+  int timer = sched_start(max_jobs);
+  stats.parallel = 1;
+  start_cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  current_cwd = -1;
+  first_unfinished = 0;
+  deferred_cd = -1;
+
+  for (int i = first; i < job_count; i += step)
   {
-    if (!is_batch_mode) //in interactive mode
+    if (jobs[i].pending == 0)
     {
-      printf ("msh> "); //prints out the msh prompt
+      job_make_ready(i);
+    }
+  }
 
-      //reads the command from the command line
-      //the while command will wait here until the user inputs something
-      if (!fgets(command_string, MAX_COMMAND_SIZE, stdin))
+  int running = 0;
+  while (1)
+  {
+    int index;
+    while (running < sched_control.limit && (index = next_ready_job()) >= 0)
+    {
+      if (start_job(index))
       {
-        break; //reached EOF
+        tag_group_hold(jobs[index].group, 1);
+        tag_group_take(jobs[index].group);
+        running++;
       }
     }
-    else //in batch mode
+    int throttled = running < sched_control.limit && ready_count > 0 && rate_rearm();
+    if (running == 0 && delayed_count == 0 && !throttled)
+    {
+      break;
+    }
+
+    struct epoll_event events[SERVE_MAX_EVENTS];
+    int n = epoll_wait(sched_epoll, events, SERVE_MAX_EVENTS, -1);
+    for (int i = 0; i < n; i++)
     {
-      if (!fgets(command_string, MAX_COMMAND_SIZE, batch_file))
+      if (events[i].data.u32 == SCHED_TIMER)
       {
-        break;
+        uint64_t expirations;
+        read(timer, &expirations, sizeof(expirations));
+        sched_tick(running, ready_count);
+        continue;
+      }
+      if (events[i].data.u32 == SCHED_DELAY)
+      {
+        delay_expired();
+        continue;
+      }
+      if (events[i].data.u32 == SCHED_RATE)
+      {
+        uint64_t expirations;
+        read(rate_timer, &expirations, sizeof(expirations));
+        continue;
+      }
+      if (events[i].data.u32 & JOB_TIMER_EVENT)
+      {
+        struct job *job = &jobs[events[i].data.u32 & ~JOB_TIMER_EVENT];
+        child_timer_expired(&job->timer, job->pid);
+        continue;
+      }
+      int index = events[i].data.u32;
+      struct job *job = &jobs[index];
+      int wstatus;
+      struct rusage usage;
+      if (wait4(job->pid, &wstatus, WNOHANG, &usage) != job->pid)
+      {
+        continue;
+      }
+      sched_control.child_cpu += usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+                                 usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+      epoll_ctl(sched_epoll, EPOLL_CTL_DEL, job->pidfd, NULL);
+      close(job->pidfd);
+      job->pidfd = -1;
+      tag_group_hold(job->group, -1);
+      running--;
+      job->path += now_seconds() - job->start;
+      int status = capture_status(job->capture_report, job->timer.stage > 0 ? STATUS_TIMEOUT : exit_code(wstatus));
+      job->capture_report = -1;
+      child_timer_stop(&job->timer); //closing it also takes it out of the epoll set
+      if (job->memo_key != NULL)
+      {
+        if (enter_job_cwd(job) == 0) //a relative --cache directory is relative to it
+        {
+          memo_account(job->memo_key);
+        }
+        free(job->memo_key);
+        job->memo_key = NULL;
+      }
+      if (retryable(status) && job->exit_attempts < job->retry)
+      {
+        job->exit_attempts++;
+        stats.reruns++;
+        job_reset_run(job);
+        job_delay(index, backoff_delay(job->exit_attempts));
+        continue;
       }
+      stats.recovered += status == 0 && job->exit_attempts > 0;
+      job->path_lines++;
+      finish_job(index, status);
     }
+  }
 
-    command_string[strcspn(command_string, "\n")] = '\0'; //replaces newline with null terminator
+  if (timer >= 0)
+  {
+    close(timer);
+  }
+  if (delay_timer >= 0)
+  {
+    close(delay_timer);
+    delay_timer = -1;
+  }
+  if (rate_timer >= 0)
+  {
+    close(rate_timer);
+    rate_timer = -1;
+  }
+  free(delayed);
+  delayed = NULL;
+  delayed_count = delayed_capacity = 0;
+  close(sched_epoll);
+  sched_epoll = -1;
+  struct job start = {.cwd = -1};
+  enter_job_cwd(&start); //back where the batch started
+  close(start_cwd_fd);
+  start_cwd_fd = -1;
+}
 
-    if (strlen(command_string) == 0) //skip empty input lines and prompt user again
+static int fanout_applies(int max_jobs)
+{
+  if (fanout < 2 || max_jobs < 2 || sched_control.adaptive || dedup || global_rate.rate > 0)
+  {
+    return 0;
+  }
+  for (int t = 0; t < tag_count; t++)
+  {
+    if (tag_limit[t] > 0 || tag_rate[t].rate > 0)
     {
-      continue;
+      return 0;
     }
-
-    ///* Parse input command into tokens *///
-    char *token[MAX_NUM_ARGUMENTS]; //holds commands and arguments (tokens)
-
-    int token_count = 0;                                 
-
-    char *argument_pointer; //pointer to current argument parsed by strsep                                  
-                                                           
-    char *working_string = strdup(command_string); //duplicates command string for parsing       
-
-    //we are going to move the working_string pointer to
-    //keep track of its original value so we can deallocate
-    //the correct amount at the end
-    
-    char *head_ptr = working_string; //used to free working_string at later point
-    
-    //strsep() splits working_string into tokens based on delimiters
-    //each call to strsep() updates working_string to point to the next part of the string
-    while (((argument_pointer = strsep(&working_string, WHITESPACE)) != NULL) &&//while more tokens
-              (token_count < MAX_NUM_ARGUMENTS - 1)) //reserving space for the NULL terminator
+  }
+  for (int i = 0; i < job_count; i++)
+  {
+    if (jobs[i].pending > 0 || jobs[i].next_count > 0 || jobs[i].barrier || jobs[i].is_cd || jobs[i].bad_label)
     {
-      if(strlen(argument_pointer) > 0) //skip tokens that might result from consecutive delimiters
-      //argument_pointer contains token obtained by strsep()
-      {
-        token[token_count] = strdup(argument_pointer); //duplicate token and store in token array
-        token_count++;
-      }
+      return 0;
     }
-    token[token_count] = NULL; //has to be NULL terminated for execv to work
+  }
+  return job_count > 0;
+}
 
-    if (token_count == 0) //skip if no tokens found and prompt user again
+//adds up what the helpers report until all of them are done, lines of a
+//helper that died without reporting them count as failed
+static void fanout_collect(struct pollfd *pipes, long *unreported, int helpers)
+{
+  struct fanout_record records[512];
+  int open_pipes = helpers;
+  while (open_pipes > 0)
+  {
+    if (poll(pipes, helpers, -1) < 0)
     {
-      free(head_ptr);
       continue;
     }
-
-    //handles built-in commands: exit and quit
-    if (strcmp(token[0], "exit") == 0 || strcmp(token[0], "quit") == 0)
+    for (int h = 0; h < helpers; h++)
     {
-      if (token_count != 1)
+      if (pipes[h].fd < 0 || pipes[h].revents == 0)
       {
-        write(STDERR_FILENO, error_message, strlen(error_message));
+        continue;
       }
-      else
+      //records are written whole and are smaller than PIPE_BUF, so a read
+      //never ends in the middle of one
+      ssize_t n = read(pipes[h].fd, records, sizeof(records));
+      if (n < 0 && errno == EINTR)
       {
-        free(head_ptr);
-        free(command_string);
-        exit(0);
+        continue;
       }
-      for (int i = 0; i < token_count; i++)
+      if (n <= 0)
       {
-        free(token[i]);
+        close(pipes[h].fd);
+        pipes[h].fd = -1;
+        open_pipes--;
+        continue;
       }
-      continue;
+      for (size_t i = 0; i < n / sizeof(struct fanout_record); i++)
+      {
+        count_status(records[i].status);
+        journal_record(records[i].line_number, records[i].status);
+        unreported[h]--;
+      }
+    }
+  }
+}
+
+//returns -1 if the helpers could not be set up and nothing was run
+static int run_fanout(int max_jobs)
+{
+  int helpers = fanout < max_jobs ? fanout : max_jobs;
+  struct pollfd *pipes = calloc(helpers, sizeof(struct pollfd));
+  pid_t *pids = calloc(helpers, sizeof(pid_t));
+  long *unreported = calloc(helpers, sizeof(long));
+  struct fanout_share *shares = mmap(NULL, helpers * sizeof(struct fanout_share), PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  int started = 0;
+  if (shares == MAP_FAILED)
+  {
+    free(pipes);
+    free(pids);
+    free(unreported);
+    return -1;
+  }
+  fflush(stdout);
+  fflush(stderr);
+
+  for (int h = 0; h < helpers; h++)
+  {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0)
+    {
+      break;
+    }
+    pids[h] = fork_retry();
+    if (pids[h] < 0)
+    {
+      close(fds[0]);
+      close(fds[1]);
+      break;
     }
-    else if (strcmp(token[0], "cd") == 0) //handles built in cd command to change directories
+    if (pids[h] == 0)
     {
-      if (token_count != 2) //expects one arg with cd
+      for (int i = 0; i < h; i++)
       {
-        write(STDERR_FILENO, error_message, strlen(error_message));
+        close(pipes[i].fd);
       }
-      else
+      close(fds[0]);
+      fanout_pipe = fds[1];
+      schedule_jobs(max_jobs / helpers + (h < max_jobs % helpers), h, helpers);
+      shares[h].stats = stats;
+      shares[h].fork_retries = fork_retries;
+      shares[h].fork_failures = fork_failures;
+      _exit(0);
+    }
+    close(fds[1]);
+    pipes[h].fd = fds[0];
+    pipes[h].events = POLLIN;
+    unreported[h] = (job_count - h + helpers - 1) / helpers;
+    started++;
+  }
+
+  if (started < helpers) //the lines were dealt for all of them
+  {
+    for (int h = 0; h < started; h++)
+    {
+      kill(pids[h], SIGKILL);
+      close(pipes[h].fd);
+      waitpid(pids[h], NULL, 0);
+    }
+    started = -1;
+  }
+  else
+  {
+    fanout_collect(pipes, unreported, helpers);
+    for (int h = 0; h < helpers; h++)
+    {
+      int wstatus;
+      while (waitpid(pids[h], &wstatus, 0) < 0 && errno == EINTR)
       {
-        if (chdir(token[1]) != 0) //change directory
-        {
-          write(STDERR_FILENO, error_message, strlen(error_message)); //directory does not exist
-        }
       }
-      //free memory and prompt user
-      free(head_ptr);
-      for (int i = 0; i < token_count; i++)
+      for (long i = 0; i < unreported[h]; i++)
+      {
+        print_error();
+        count_status(STATUS_ERROR);
+      }
+      if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0)
+      {
+        continue; //its counters were never written
+      }
+      struct run_stats *helper = &shares[h].stats;
+      stats.up_to_date += helper->up_to_date;
+      stats.saved += helper->saved;
+      stats.memo_hits += helper->memo_hits;
+      stats.memo_saved += helper->memo_saved;
+      stats.resumed += helper->resumed;
+      stats.reruns += helper->reruns;
+      stats.recovered += helper->recovered;
+      if (helper->critical_path > stats.critical_path)
       {
-        free(token[i]);
+        stats.critical_path = helper->critical_path;
+        stats.critical_lines = helper->critical_lines;
       }
-      continue; 
+      fork_retries += shares[h].fork_retries;
+      fork_failures += shares[h].fork_failures;
     }
+    stats.parallel = 1;
+    started = 0;
+  }
+  munmap(shares, helpers * sizeof(struct fanout_share));
+  free(pipes);
+  free(pids);
+  free(unreported);
+  return started;
+}
+
+static void run_jobs(FILE *batch_file, int max_jobs)
+{
+  load_jobs(batch_file);
+  if (!fanout_applies(max_jobs) || run_fanout(max_jobs) != 0)
+  {
+    schedule_jobs(max_jobs, 0, 1);
+  }
+  free_label_map(&in_flight);
+  free_tag_groups();
+  free(jobs);
+}
+
+int main(int argc, char* argv[] )
+{
+
+  char* command_string = (char*)malloc(MAX_COMMAND_SIZE); //holds user's input command
+
+  FILE* batch_file = NULL; //batch mode file pointer
+  int compile = 0;
+  int nul_input = 0;
+  const char *ring_name = NULL;
+  const char *serve_path = NULL;
+  int coordinate = 0;
+  int max_jobs = 0; //run batch lines in parallel when set
+  const char *cache_dir = NULL;
+  const char *journal_path = NULL;
+  int resume = 0;
+  const char *watch_path = NULL;
+  int rate_limited = 0;
+  int zygote = 0;
 
-    //handles external commands
-    char *path[] = {"/bin/", "/usr/bin/", "/usr/local/bin/", "./"}; //where executable commands are
-    char cmd_path[MAX_PATH]; //full path for the command
-    int found = 0;
+  static const struct option long_options[] =
+  {
+    {"compile", no_argument, NULL, 'c'}, //--compile batch_file [plan_file]
+    {"null", no_argument, NULL, '0'}, //-0 [file]: NUL delimited arguments
+    {"ring", required_argument, NULL, 'r'}, //--ring name: shared memory submission ring
+    {"serve", required_argument, NULL, 's'}, //--serve path: Unix socket daemon
+    {"worker", required_argument, NULL, 's'}, //--worker path: daemon a coordinator sends lines to
+    {"coordinate", no_argument, NULL, 'C'}, //--coordinate batch_file socket...
+    {"jobs", required_argument, NULL, 'j'}, //-j n|auto: up to n batch lines at a time
+    {"sched-log", required_argument, NULL, 'L'}, //--sched-log file: -j auto decisions
+    {"pressure-dir", required_argument, NULL, 'p'}, //--pressure-dir dir: PSI files for -j auto
+    {"limit", required_argument, NULL, 'T'}, //--limit tag=n: running lines tagged @tag
+    {"timeout", required_argument, NULL, 'O'}, //--timeout time: default for @timeout
+    {"stats", no_argument, NULL, 'S'}, //--stats: summary on stderr at exit
+    {"cache", required_argument, NULL, 'M'}, //--cache dir: replay @pure lines
+    {"cache-size", required_argument, NULL, 'Z'}, //--cache-size n[K|M|G]: limit of the cache
+    {"journal", required_argument, NULL, 'J'}, //--journal file: record finished batch lines
+    {"resume", no_argument, NULL, 'R'}, //--resume: skip lines the journal has as succeeded
+    {"watch", required_argument, NULL, 'W'}, //--watch batch_file: rerun what changed
+    {"dedup", no_argument, NULL, 'D'}, //--dedup: identical running lines run once with -j
+    {"rate", required_argument, NULL, 'P'}, //--rate [tag=]n/s: pace starts of lines
+    {"fanout", required_argument, NULL, 'F'}, //--fanout k: -j lines started by k helpers
+    {"zygote", no_argument, NULL, 'Y'}, //--zygote: a helper forked at startup runs commands
+    {NULL, 0, NULL, 0}
+  };
 
-    for (int i = 0; i < 4; i++) //loop through each directory in path[]
+  opterr = 0; //getopt must not print its own messages
+  int opt;
+  while ((opt = getopt_long(argc, argv, "+0j:", long_options, NULL)) != -1)
+  {
+    switch (opt)
     {
-      //build full path of command by combining directory and command name (ex: /bin/ls for ls)
-      snprintf(cmd_path, sizeof(cmd_path), "%s%s", path[i], token[0]);
-      if (access(cmd_path, X_OK) == 0) //file exists in dir and is executable if access() returns 0
-      {
-        found = 1;
+      case 'c':
+        compile = 1;
         break;
-      }
+      case '0':
+        nul_input = 1;
+        break;
+      case 'r':
+        ring_name = optarg;
+        break;
+      case 's':
+        serve_path = optarg;
+        break;
+      case 'C':
+        coordinate = 1;
+        break;
+      case 'j':
+        sched_control.cpus = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+        sched_control.max_limit = sched_control.cpus * SCHED_MAX_PER_CPU;
+        sched_control.adaptive = strcmp(optarg, "auto") == 0;
+        max_jobs = sched_control.adaptive ? sched_control.cpus : atoi(optarg);
+        if (max_jobs <= 0)
+        {
+          print_error();
+          exit(1);
+        }
+        break;
+      case 'S':
+        stats.enabled = 1;
+        break;
+      case 'M':
+        cache_dir = optarg;
+        break;
+      case 'J':
+        journal_path = optarg;
+        break;
+      case 'R':
+        resume = 1;
+        break;
+      case 'W':
+        watch_path = optarg;
+        break;
+      case 'D':
+        dedup = 1;
+        break;
+      case 'O':
+        if (parse_duration(optarg, &default_timeout) != 0)
+        {
+          print_error();
+          exit(1);
+        }
+        break;
+      case 'Y':
+        zygote = 1;
+        break;
+      case 'F':
+        if (parse_int(optarg, 1, 1024, &fanout) != 0)
+        {
+          print_error();
+          exit(1);
+        }
+        break;
+      case 'P':
+        rate_limited = 1;
+        if (set_rate(optarg) != 0)
+        {
+          print_error();
+          exit(1);
+        }
+        break;
+      case 'T':
+        if (set_tag_limit(optarg) != 0)
+        {
+          print_error();
+          exit(1);
+        }
+        break;
+      case 'p':
+        sched_control.pressure_dir = optarg;
+        break;
+      case 'L':
+        sched_control.log = fopen(optarg, "we");
+        if (sched_control.log == NULL)
+        {
+          print_error();
+          exit(1);
+        }
+        break;
+      case 'Z':
+        if (parse_size(optarg, &memo_limit) != 0)
+        {
+          print_error();
+          exit(1);
+        }
+        break;
+      default:
+        print_error();
+        exit(1);
     }
+  }
+  argc -= optind - 1; //from here on argv[1] is the first file argument
+  argv += optind - 1;
+  if (rate_limited && max_jobs == 0) //pacing is done by the -j scheduler
+  {
+    max_jobs = 1;
+  }
+  if (zygote && zygote_start() != 0) //before any cache or batch is loaded
+  {
+    print_error();
+    exit(1);
+  }
+
+  if (stats.enabled)
+  {
+    stats.start = now_seconds();
+    atexit(print_stats); //children never run it, they leave through _exit()
+  }
+
+  if (cache_dir != NULL && memo_open(cache_dir) != 0)
+  {
+    print_error();
+    exit(1);
+  }
 
-    //if found = 0, command not found so clean memory and prompt user again
-    if (!found)
+  if (compile)
+  {
+    char plan_path[MAX_PATH];
+    if (argc < 2 || argc > 3)
     {
-      write(STDERR_FILENO, error_message, strlen(error_message));
-      free(head_ptr);
-      for (int i = 0; i < token_count; i++)
-      {
-        free(token[i]);
-      }
-      continue;
+      print_error();
+      exit(1);
+    }
+    init_lookup_cache();
+    snprintf(plan_path, sizeof(plan_path), "%s%s", argv[1], PLAN_SUFFIX);
+    if (compile_batch_file(argv[1], argc == 3 ? argv[2] : plan_path) != 0)
+    {
+      print_error();
+      exit(1);
     }
+    exit(0);
+  }
 
-    pid_t child_pid = fork(); //new process created
-    int status;
+  if (coordinate)
+  {
+    if (argc < 3)
+    {
+      print_error();
+      exit(1);
+    }
+    init_lookup_cache();
+    if (run_coordinator(argv[1], argv + 2, argc - 2) != 0)
+    {
+      print_error();
+      exit(1);
+    }
+    free(command_string);
+    return coord_status;
+  }
 
-    if (child_pid == -1) //fork failed
+  if (argc > 2)
+  {
+    print_error();
+    exit(1);
+  }
+
+  if (serve_path != NULL)
+  {
+    if (argc != 1)
     {
-      write(STDERR_FILENO, error_message, strlen(error_message));
-      free(head_ptr);
-      for (int i = 0; i < token_count; i++)
-      {
-        free(token[i]);
-      }
-      continue;
+      print_error();
+      exit(1);
+    }
+    init_lookup_cache();
+    if (run_server(serve_path) != 0)
+    {
+      print_error();
+      exit(1);
     }
+    free(command_string);
+    return 0;
+  }
 
-    if (child_pid == 0)
+  if (ring_name != NULL)
+  {
+    size_t ring_bytes;
+    struct ring_header *ring = argc == 1 ? attach_ring(ring_name, &ring_bytes) : NULL;
+    if (ring == NULL)
     {
-      //redirection
-      int redirection_found = 0;
-      int i;
-      for (i = 0; token[i] != NULL; i++)
-      {
-        if (strcmp(token[i], ">") == 0)
-        {
-          if (redirection_found)
-          {
-            write(STDERR_FILENO, error_message, strlen(error_message));
-            exit(1);
-          }
+      print_error();
+      exit(1);
+    }
+    init_lookup_cache();
+    run_ring(ring);
+    munmap(ring, ring_bytes);
+    free(command_string);
+    return 0;
+  }
 
-          redirection_found = 1;
+  if (nul_input)
+  {
+    int fd = STDIN_FILENO;
+    if (argc == 2 && (fd = open(argv[1], O_RDONLY | O_CLOEXEC)) < 0)
+    {
+      print_error();
+      exit(1);
+    }
+    init_lookup_cache();
+    run_nul_input(fd);
+    free(command_string);
+    return 0;
+  }
 
-          if (token[i + 1] == NULL || token[i + 2] != NULL) //valid output file check after >
-          {
-            write(STDERR_FILENO, error_message, strlen(error_message));
-            exit(1);
-          }
+  if (watch_path != NULL)
+  {
+    init_lookup_cache();
+    if (argc != 1 || run_watch(watch_path) != 0)
+    {
+      print_error();
+      exit(1);
+    }
+  }
 
-          //opening file for redirection
-          int fd = open(token[i + 1], O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
-          if (fd < 0)
-          {
-            write(STDERR_FILENO, error_message, strlen(error_message));
-            exit(1);
-          }
-          dup2(fd, STDOUT_FILENO); //redirect stdout to file
-          dup2(fd, STDERR_FILENO); //redirect stderr to file
-          close(fd);
+  if ((resume && journal_path == NULL) ||
+      (journal_path != NULL && (argc != 2 || journal_open(journal_path, argv[1], resume) != 0)))
+  {
+    print_error();
+    exit(1);
+  }
 
-          token[i] = NULL; //trim off the > and output file
-          break;
-        }
-      }
+  if (argc == 2 && max_jobs > 0)
+  {
+    batch_file = fopen(argv[1], "re");
+    if (batch_file == NULL)
+    {
+      print_error();
+      exit(1);
+    }
+    init_lookup_cache();
+    run_jobs(batch_file, max_jobs);
+    fclose(batch_file);
+    free(command_string);
+    return 0;
+  }
 
-      //execv replaces current process with new process
-      //takes a path to the executable and an array of NULL terminated arguments
-      if (execv(cmd_path, token) == -1)
-      {
-        //could not run executable
-        write(STDERR_FILENO, error_message, strlen(error_message));
-        exit(1);
-      }
+  if (argc == 2)
+  {
+    size_t plan_size;
+    //plans are not numbered by batch file line, so a journal needs the source
+    char *plan = journal_path == NULL ? find_plan(argv[1], &plan_size) : NULL;
+    if (plan != NULL)
+    {
+      init_lookup_cache();
+      run_plan(plan, plan_size);
+      munmap(plan, plan_size);
+      free(command_string);
+      return 0;
     }
-    else
+
+    batch_file = fopen(argv[1], "re");
+    if (batch_file == NULL)
     {
-      waitpid(child_pid, &status, 0); //waits until child changes state
-      //status stores the exit status of the child
+      print_error();
+      exit(1);
+    }
+  }
+
+  init_lookup_cache();
+
+  if (batch_file) //in batch mode
+  {
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, batch_reader, batch_file) != 0)
+    {
+      print_error();
+      exit(1);
     }
-    
-    free(head_ptr); //frees memory allocated by strdup() for working_string
-    for (int i = 0; i < token_count; i++) //frees each token duplicated by strdup()
+
+    struct command *cmd;
+    while (!(cmd = batch_queue_peek())->eof)
     {
-      free(token[i]);
+      run_line(cmd);
+      free_command(cmd);
+      batch_queue_release();
     }
 
+    pthread_join(reader, NULL);
+    fclose(batch_file);
+    free(command_string);
+    return 0;
   }
 
-  if (batch_file)
+  line_annotations = 0; //annotations are batch syntax
+  while(1) //main shell interaction loop
   {
-    fclose(batch_file);
+    printf ("msh> "); //prints out the msh prompt
+
+    //reads the command from the command line
+    //the while command will wait here until the user inputs something
+    if (!fgets(command_string, MAX_COMMAND_SIZE, stdin))
+    {
+      break; //reached EOF
+    }
+
+    command_string[strcspn(command_string, "\n")] = '\0'; //replaces newline with null terminator
+
+    ///* Parse input command into tokens *///
+    struct command cmd;
+    if (parse_command(command_string, &cmd) == 0) //skip if no tokens found and prompt user again
+    {
+      continue;
+    }
+    if (!is_builtin(cmd.token[0]))
+    {
+      resolve_parsed_command(&cmd);
+    }
+    run_line(&cmd);
+    free_command(&cmd);
   }
 
   free(command_string);